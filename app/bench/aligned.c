@@ -0,0 +1,91 @@
+/**
+ * Throughput with aligned vs. unaligned caller buffers.
+ *
+ * Writes and reads a synthetic u16 stack through the plugin twice: once from
+ * a buffer whose base and line stride are 64-byte aligned, and once from the
+ * same data shifted by one pixel so no row is 16-byte aligned.  Both the
+ * plain path (swscale) and the split16 path (the byte merge kernel) are
+ * measured.  split16 needs a container that carries its FFV1 low-byte
+ * stream, so both cases use mkv or nut.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include "tictoc.h"
+#include <stdlib.h> // for rand
+#include <stdio.h>  // for printf
+#include <stdint.h> // for uintptr_t
+#include <string.h> // for memcpy
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define W     (1024) // rows of 2048 bytes keep every row aligned when the base is
+#define H     (1024)
+#define D     (32)
+#define ALIGN (64)
+
+/** Fills \a a with a smooth background plus noise. */
+static nd_t fill(nd_t a)
+{ unsigned short *d=(unsigned short*)nddata(a);
+  size_t i;
+  for(i=0;i<ndnelem(a);++i)
+    d[i]=(unsigned short)(1000+((i+i/W)&0x3ff)+(rand()&0x3f));
+  return a;
+}
+
+/** Points \a a at \a buf, rounded up to ALIGN and then moved \a offset bytes. */
+static nd_t place(nd_t a, void *buf, size_t offset)
+{ uintptr_t p=((uintptr_t)buf+ALIGN-1)&~(uintptr_t)(ALIGN-1);
+  return ndref(a,(void*)(p+offset),nd_static);
+}
+
+/** Writes \a a to \a path, then reads it back into \a a.  Reports MB/s for each. */
+static int run(const char *label, const char *path, int split16, nd_t a)
+{ ndio_t f=0;
+  ndio_ffmpeg_params_t params;
+  double mb=ndnbytes(a)/1024.0/1024.0,tw,tr;
+  TRY(f=ndioOpen(path,"ffmpeg","w"));
+  memcpy(&params,ndioGet(f),sizeof(params));
+  params.lossless=!split16;
+  params.split16=split16;
+  TRY(ndioSet(f,&params,sizeof(params)));
+  tic();
+  TRY(ndioWrite(f,a));
+  ndioClose(f);
+  f=0;
+  tw=toc(NULL);
+
+  TRY(f=ndioOpen(path,"ffmpeg","r"));
+  tic();
+  TRY(ndioRead(f,a));
+  tr=toc(NULL);
+  ndioClose(f);
+  LOG("%-22s %10.1f %10.1f\n",label,mb/tw,mb/tr);
+  return 1;
+Error:
+  ndioClose(f);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{ int  eflag=0;
+  nd_t a=0;
+  void *buf=0;
+  TRY(ndcast(ndreshapev(a=ndinit(),3,W,H,D),nd_u16));
+  TRY(buf=malloc(ndnbytes(a)+2*ALIGN));
+
+  LOG("%dx%dx%d u16 (%.1f MB)\n",W,H,D,ndnbytes(a)/1024.0/1024.0);
+  LOG("%-22s %10s %10s\n","","write MB/s","read MB/s");
+  TRY(run("lossless, aligned"  ,"aligned.mkv",0,fill(place(a,buf,0))));
+  TRY(run("lossless, unaligned","aligned.mkv",0,fill(place(a,buf,sizeof(unsigned short)))));
+  TRY(run("split16, aligned"   ,"aligned.nut",1,fill(place(a,buf,0))));
+  TRY(run("split16, unaligned" ,"aligned.nut",1,fill(place(a,buf,sizeof(unsigned short)))));
+Finalize:
+  ndfree(a);
+  if(buf) free(buf);
+  return eflag;
+Error:
+  eflag=1;
+  goto Finalize;
+}
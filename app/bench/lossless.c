@@ -0,0 +1,105 @@
+/**
+ * Round trip and throughput benchmark for the lossless (FFV1) writer.
+ *
+ * Writes a synthetic u16 stack with the lossless option set, reads it back,
+ * verifies the result is bit-exact and reports encode/decode throughput and
+ * compression ratio.  A second, smaller stack with odd width and height
+ * checks that odd sizes are padded and cropped rather than resampled.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include "tictoc.h"
+#include <stdlib.h> // for rand
+#include <stdio.h>  // for printf
+#include <string.h> // for memcmp
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define W    (1024)
+#define H    (1024)
+#define D    (64)
+#define PATH "lossless.mkv"
+
+/** Fills \a a with something that looks a bit like an image: a smooth background plus shot-ish noise. */
+nd_t fill(nd_t a)
+{ unsigned short *d=(unsigned short*)nddata(a);
+  const size_t w=ndshape(a)[0],h=ndshape(a)[1],depth=ndshape(a)[2];
+  size_t x,y,z;
+  for(z=0;z<depth;++z)
+    for(y=0;y<h;++y)
+      for(x=0;x<w;++x)
+        *d++=(unsigned short)(1000+((x+y+z)&0x3ff)+(rand()&0x3f));
+  return a;
+}
+
+static long filesize(const char *path)
+{ long n=-1;
+  FILE *fp=fopen(path,"rb");
+  if(fp && 0==fseek(fp,0,SEEK_END))
+    n=ftell(fp);
+  if(fp) fclose(fp);
+  return n;
+}
+
+/** Writes a w x h x d u16 stack losslessly, reads it back and reports.
+ *  \returns 1 if the read back is bit-exact and has the written shape, otherwise 0.
+ */
+static int roundtrip(size_t w, size_t h, size_t d)
+{ int ok=0;
+  nd_t shape=0,a=0,b=0;
+  ndio_t f=0;
+  double mb,tw,tr;
+  TRY(ndcast(ndreshapev(shape=ndinit(),3,w,h,d),nd_u16));
+  TRY(a=fill(ndheap(shape)));
+  mb=ndnbytes(a)/1024.0/1024.0;
+
+  { ndio_ffmpeg_params_t params;
+    TRY(f=ndioOpen(PATH,"ffmpeg","w"));
+    memcpy(&params,ndioGet(f),sizeof(params));
+    params.lossless=1;
+    TRY(ndioSet(f,&params,sizeof(params)));
+    tic();
+    TRY(ndioWrite(f,a));
+    ndioClose(f);
+    f=0;
+    tw=toc(NULL);
+  }
+
+  TRY(f=ndioOpen(PATH,"ffmpeg","r"));
+  ndfree(shape);
+  TRY(shape=ndioShape(f));
+  TRY(ndshape(shape)[0]==w && ndshape(shape)[1]==h && ndnelem(shape)==ndnelem(a)); // odd sizes come back unpadded
+  TRY(b=ndheap(shape));
+  tic();
+  TRY(ndioRead(f,b));
+  tr=toc(NULL);
+
+  LOG("Lossless round trip of %dx%dx%d u16 (%.1f MB)\n",(int)w,(int)h,(int)d,mb);
+  LOG("\tencode: %8.1f MB/s\n",mb/tw);
+  LOG("\tdecode: %8.1f MB/s\n",mb/tr);
+  LOG("\tratio:  %8.2f\n",ndnbytes(a)/(double)filesize(PATH));
+  if(memcmp(nddata(a),nddata(b),ndnbytes(a)))
+    LOG("\tFAILED: read back differs from what was written.\n");
+  else
+  { LOG("\tbit-exact: yes\n");
+    ok=1;
+  }
+Finalize:
+  ndioClose(f);
+  ndfree(shape);
+  ndfree(a);
+  ndfree(b);
+  return ok;
+Error:
+  ok=0;
+  goto Finalize;
+}
+
+int main(int argc, char* argv[])
+{ int eflag=0;
+  if(!roundtrip(W,H,D))           eflag=1;
+  if(!roundtrip(W/4-1,H/4-1,D/4)) eflag=1; // odd width and height
+  return eflag;
+}
@@ -0,0 +1,201 @@
+/**
+ * Seek cost vs. size for the encoding profiles.
+ *
+ * Writes a sample stack once per profile (see ndio_ffmpeg_params_t::profile)
+ * and reports, for each:
+ *   - the compressed size,
+ *   - the expected number of frames decoded to reach a random frame, from the
+ *     keyframe layout of the written stream, and
+ *   - the measured time for a random single plane read, and
+ *   - how many of those reads returned some other plane than the one asked
+ *     for (should be 0).
+ *
+ * Usage: bench-ffmpeg-seekcost [sample]
+ * where sample is any file nd can read.  Without one, a synthetic u8 stack is used.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include "tictoc.h"
+#include <stdlib.h> // for rand
+#include <stdio.h>  // for printf
+#include <string.h> // for memcpy
+
+#ifdef _MSC_VER
+#define inline __forceinline
+#endif
+#include "libavformat/avformat.h"
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+#define countof(e)   (sizeof(e)/sizeof(*e))
+
+#define W     (512)
+#define H     (512)
+#define D     (256)
+#define NSEEK (200)
+
+static const char *profiles[]={"archive","random-access","intra"};
+
+/** A drifting gradient with a little noise, so motion compensation has something to do. */
+nd_t fill(nd_t a)
+{ unsigned char *d=(unsigned char*)nddata(a);
+  size_t x,y,z;
+  for(z=0;z<D;++z)
+    for(y=0;y<H;++y)
+      for(x=0;x<W;++x)
+        *d++=(unsigned char)(((x+2*z)^(y+z))+(rand()&0x7));
+  return a;
+}
+
+static long filesize(const char *path)
+{ long n=-1;
+  FILE *fp=fopen(path,"rb");
+  if(fp && 0==fseek(fp,0,SEEK_END))
+    n=ftell(fp);
+  if(fp) fclose(fp);
+  return n;
+}
+
+/** Mean number of frames decoded to reach each frame: the distance (in decode
+ *  order) back to the keyframe before it, inclusive.
+ *  \returns -1 on failure.
+ */
+static double frames_per_seek(const char *path)
+{ AVFormatContext *fmt=0;
+  AVPacket p;
+  int64_t j=0,k=0;
+  double sum=0.0;
+  int s;
+  TRY(avformat_open_input(&fmt,path,NULL,NULL)>=0);
+  TRY(avformat_find_stream_info(fmt,NULL)>=0);
+  TRY((s=av_find_best_stream(fmt,AVMEDIA_TYPE_VIDEO,-1,-1,NULL,0))>=0);
+  av_init_packet(&p);
+  while(av_read_frame(fmt,&p)>=0)
+  { if(p.stream_index==s)
+    { if(p.flags&AV_PKT_FLAG_KEY)
+        k=j;
+      sum+=(double)(j-k+1);
+      ++j;
+    }
+    av_free_packet(&p);
+  }
+  avformat_close_input(&fmt);
+  return j?sum/(double)j:-1.0;
+Error:
+  if(fmt) avformat_close_input(&fmt);
+  return -1.0;
+}
+
+/** Sum of absolute byte differences between \a plane and plane \a z of \a src. */
+static double distance(nd_t plane, nd_t src, size_t z)
+{ const size_t n=ndstrides(src)[2];
+  const unsigned char *p=(const unsigned char*)nddata(plane),
+                      *q=(const unsigned char*)nddata(src)+n*z;
+  size_t i;
+  double d=0.0;
+  for(i=0;i<n;++i)
+    d+=(p[i]>q[i])?(p[i]-q[i]):(q[i]-p[i]);
+  return d;
+}
+
+/** \returns 1 if \a plane is nearer plane \a z of \a src than the planes next to it.
+ *  Encoding is lossy, so this is how a read is matched to the plane it came from.
+ */
+static int is_plane(nd_t plane, nd_t src, size_t z)
+{ const size_t d=ndshape(src)[2];
+  const double dz=distance(plane,src,z);
+  return (z==0   || dz<distance(plane,src,z-1))
+      && (z+1==d || dz<distance(plane,src,z+1));
+}
+
+/** Mean time in ms to read a randomly chosen plane.
+ *  \param[out] nwrong The number of reads that didn't return the plane of \a src asked for.
+ *                     Only counted when the file reads back as the type \a src was written as.
+ */
+static double ms_per_seek(const char *path, nd_t src, int *nwrong)
+{ ndio_t f=0;
+  nd_t shape=0,a=0;
+  size_t i,max,origin[8]={0};
+  double t=0.0;
+  int check;
+  *nwrong=0;
+  TRY(f=ndioOpen(path,"ffmpeg","r"));
+  TRY(shape=ndioShape(f));
+  max=ndshape(shape)[2];
+  ndshape(shape)[2]=1;
+  TRY(a=ndheap(shape));
+  check=(ndtype(a)==ndtype(src) && max==ndshape(src)[2] && ndnbytes(a)==ndstrides(src)[2]);
+  for(i=0;i<NSEEK;++i)
+  { origin[2]=rand()%max;
+    tic();
+    TRY(ndioReadSubarray(f,a,origin,NULL));
+    t+=toc(NULL);
+    if(check && !is_plane(a,src,origin[2]))
+      ++*nwrong;
+  }
+  ndioClose(f);
+  ndfree(shape);
+  ndfree(a);
+  return 1000.0*t/NSEEK;
+Error:
+  ndioClose(f);
+  ndfree(shape);
+  ndfree(a);
+  return -1.0;
+}
+
+int main(int argc, char* argv[])
+{ int  eflag=0;
+  nd_t shape=0,a=0;
+  ndio_t f=0;
+  size_t i;
+  av_register_all();
+
+  if(argc>1)
+  { TRY(f=ndioOpen(argv[1],NULL,"r"));
+    TRY(shape=ndioShape(f));
+    TRY(a=ndheap(shape));
+    TRY(ndioRead(f,a));
+    ndioClose(f);
+    f=0;
+  } else
+  { TRY(ndcast(ndreshapev(shape=ndinit(),3,W,H,D),nd_u8));
+    TRY(a=fill(ndheap(shape)));
+  }
+
+  LOG("%-14s %10s %8s %14s %10s %8s\n","profile","size (MB)","ratio","frames/seek","ms/seek","wrong");
+  for(i=0;i<countof(profiles);++i)
+  { ndio_ffmpeg_params_t params;
+    char path[64];
+    long n;
+    double ms;
+    int nwrong;
+    sprintf(path,"seekcost-%s.mp4",profiles[i]);
+    TRY(f=ndioOpen(path,"ffmpeg","w"));
+    memcpy(&params,ndioGet(f),sizeof(params));
+    params.profile=(char*)profiles[i];
+    TRY(ndioSet(f,&params,sizeof(params)));
+    TRY(ndioWrite(f,a));
+    ndioClose(f);
+    f=0;
+    TRY((n=filesize(path))>0);
+    ms=ms_per_seek(path,a,&nwrong);
+    LOG("%-14s %10.2f %8.2f %14.2f %10.2f %8d\n",
+        profiles[i],
+        n/1024.0/1024.0,
+        ndnbytes(a)/(double)n,
+        frames_per_seek(path),
+        ms,
+        nwrong);
+    if(nwrong) eflag=1;
+  }
+Finalize:
+  ndioClose(f);
+  ndfree(shape);
+  ndfree(a);
+  return eflag;
+Error:
+  eflag=1;
+  goto Finalize;
+}
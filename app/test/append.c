@@ -0,0 +1,91 @@
+/**
+ * Lossless round trip through append mode.
+ *
+ * Half the planes are written, the file is closed and reopened with mode
+ * "a", and the other half are appended.  Read back, every plane should be
+ * exactly as written.  The nut file is written with the fragment parameter,
+ * so it is extended in place; the mkv file is copied.  Both check that the
+ * appended FFV1 encoder reproduces the stream header already in the file.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include <stdio.h>  // for printf
+#include <string.h> // for memcpy
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define W (256)
+#define H (64)
+#define D (8)
+
+static unsigned short pixel(size_t i) { return (unsigned short)((i*2654435761u)>>16); }
+
+/** Opens \a path with \a mode, fragmenting the output every \a fragment planes (0 disables). */
+static ndio_t open_lossless(const char *path, const char *mode, int fragment)
+{ ndio_t f=0;
+  ndio_ffmpeg_params_t params;
+  TRY(f=ndioOpen(path,"ffmpeg",mode));
+  memcpy(&params,ndioGet(f),sizeof(params));
+  params.lossless=1;
+  params.fragment=fragment;
+  TRY(ndioSet(f,&params,sizeof(params)));
+  return f;
+Error:
+  ndioClose(f);
+  return 0;
+}
+
+/** Writes the first half of \a a, appends the second half, reads the file back into \a b and compares. */
+static int roundtrip(nd_t a, nd_t b, const char *path, int fragment)
+{ ndio_t f=0;
+  nd_t shape=0,half=0;
+  void *o=nddata(a);
+  int ok;
+  TRY(ndcast(ndreshapev(shape=ndinit(),3,W,H,D/2),nd_u16));
+  TRY(half=ndheap(shape));
+  memcpy(nddata(half),o,ndnbytes(half));
+  TRY(f=open_lossless(path,"w",fragment));
+  TRY(ndioWrite(f,half));
+  ndioClose(f);
+  memcpy(nddata(half),(unsigned char*)o+ndnbytes(half),ndnbytes(half));
+  TRY(f=open_lossless(path,"a",fragment));
+  TRY(ndioWrite(f,half));
+  ndioClose(f);
+  TRY(f=ndioOpen(path,"ffmpeg","r"));
+  TRY(ndioRead(f,b));
+  ndioClose(f);
+  f=0;
+  ok=!memcmp(nddata(a),nddata(b),ndnbytes(a));
+  LOG("append %s: %s\n",path,ok?"ok":"FAILED");
+  ndfree(shape);
+  ndfree(half);
+  return ok;
+Error:
+  ndioClose(f);
+  ndfree(shape);
+  ndfree(half);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{ int eflag=0;
+  nd_t shape=0,a=0,b=0;
+  size_t i;
+  TRY(ndcast(ndreshapev(shape=ndinit(),3,W,H,D),nd_u16));
+  TRY(a=ndheap(shape));
+  TRY(b=ndheap(shape));
+  for(i=0;i<ndnelem(a);++i)
+    ((unsigned short*)nddata(a))[i]=pixel(i);
+  if(!roundtrip(a,b,"append.nut",2)) eflag=1; // in place
+  if(!roundtrip(a,b,"append.mkv",0)) eflag=1; // copied
+Finalize:
+  ndfree(shape);
+  ndfree(a);
+  ndfree(b);
+  return eflag;
+Error:
+  eflag=1;
+  goto Finalize;
+}
@@ -0,0 +1,101 @@
+/**
+ * Reads a file in follow mode while another thread is still writing it.
+ *
+ * The writer appends planes to a lossless nut file a few at a time, flushing
+ * after each.  The reader opens the file after the first batch and reads every
+ * plane in order, so most reads land past the end of what's on disk and have
+ * to wait for it.  Each plane is checked against what was written.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include "thread.h"
+#include "libavutil/time.h"
+#include <stdio.h>  // for printf
+#include <string.h> // for memcpy
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define W      (256)
+#define H      (256)
+#define BATCH  (4)
+#define NBATCH (8)
+#define D      (BATCH*NBATCH)
+#define PATH   "follow.nut"
+
+/** Plane \a z holds (x+y+z)*37, so every plane and every pixel differs. */
+static unsigned short value(size_t x, size_t y, size_t z) { return (unsigned short)((x+y+z)*37); }
+
+static nd_t fill(nd_t a, size_t z0)
+{ unsigned short *d=(unsigned short*)nddata(a);
+  size_t x,y,z;
+  for(z=0;z<BATCH;++z)
+    for(y=0;y<H;++y)
+      for(x=0;x<W;++x)
+        *d++=value(x,y,z0+z);
+  return a;
+}
+
+typedef struct { ndio_t f; nd_t a; } writer_t;
+
+/** Writes batches 1 through NBATCH-1, pausing between them, then closes the file. */
+static unsigned writer(void *arg)
+{ writer_t *w=(writer_t*)arg;
+  size_t i;
+  for(i=1;i<NBATCH;++i)
+  { av_usleep(50000);
+    TRY(ndioWrite(w->f,fill(w->a,i*BATCH)));
+  }
+  ndioClose(w->f);
+  return 1;
+Error:
+  ndioClose(w->f);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{ int eflag=0;
+  nd_t shape=0,batch=0,plane=0;
+  ndio_t r=0;
+  thread_t t=0;
+  writer_t w={0};
+  size_t x,y,z,origin[8]={0};
+  TRY(ndcast(ndreshapev(shape=ndinit(),3,W,H,BATCH),nd_u16));
+  TRY(batch=ndheap(shape));
+  ndshape(shape)[2]=1;
+  TRY(plane=ndheap(shape));
+
+  { ndio_ffmpeg_params_t params;
+    TRY(w.f=ndioOpen(PATH,"ffmpeg","w"));
+    memcpy(&params,ndioGet(w.f),sizeof(params));
+    params.lossless=1;
+    params.fragment=1;
+    params.follow=10.0; // parameters are shared by every file the plugin opens, so this is for the reader below
+    TRY(ndioSet(w.f,&params,sizeof(params)));
+    TRY(ndioWrite(w.f,fill(batch,0)));
+  }
+  w.a=batch;
+  TRY(t=thread_start(writer,&w));
+
+  TRY(r=ndioOpen(PATH,"ffmpeg","r"));
+  for(z=0;z<D;++z)
+  { const unsigned short *d=(const unsigned short*)nddata(plane);
+    origin[2]=z;
+    TRY(ndioReadSubarray(r,plane,origin,NULL));
+    for(y=0;y<H;++y)
+      for(x=0;x<W;++x)
+        TRY(d[x+W*y]==value(x,y,z));
+  }
+  LOG("follow: read %d planes while they were written\n",D);
+Finalize:
+  if(t && !thread_join(t)) eflag=1;
+  ndioClose(r);
+  ndfree(shape);
+  ndfree(batch);
+  ndfree(plane);
+  return eflag;
+Error:
+  eflag=1;
+  goto Finalize;
+}
@@ -0,0 +1,100 @@
+/**
+ * Checks the pixel kernels against their scalar definitions.
+ *
+ * Each kernel is run over the whole u16 range, from aligned and unaligned
+ * buffers, so the SSE2 body and the scalar tail both see every input.
+ * Returns non-zero if any output differs.
+ */
+#include "kernels.h"
+#include <stdio.h>  // for printf
+#include <stdlib.h> // for malloc
+#include <math.h>   // for HUGE_VAL
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define N (1<<16)
+
+/** The definition of kern_u16_window() from kernels.h. */
+static uint8_t window(uint16_t v, uint16_t lo, uint16_t scale)
+{ unsigned r=v>lo?((unsigned)(v-lo)*scale)>>16:0;
+  return (uint8_t)(r>255?255:r);
+}
+
+/** Runs kern_u16_window() over every u16 value starting at offset \a off
+ *  in both buffers.  Returns the number of mismatches.
+ */
+static size_t check_window(uint8_t *dst, uint16_t *src, size_t off, uint16_t lo, uint16_t scale)
+{ size_t i,nbad=0;
+  for(i=0;i<N;++i) src[off+i]=(uint16_t)i;
+  kern_u16_window(dst+off,src+off,N,lo,scale);
+  for(i=0;i<N;++i)
+    if(dst[off+i]!=window((uint16_t)i,lo,scale))
+    { if(!nbad)
+        LOG("\twindow(lo=%u,scale=%u) offset %u: src=%u gave %u, expected %u\n",
+            (unsigned)lo,(unsigned)scale,(unsigned)off,(unsigned)i,(unsigned)dst[off+i],(unsigned)window((uint16_t)i,lo,scale));
+      ++nbad;
+    }
+  return nbad;
+}
+
+/** Runs kern_f32_range() over \a n samples starting at offset \a off, with a
+ *  NaN planted in the middle, and compares against a scalar scan.
+ *  \returns 1 if they agree.
+ */
+static int check_range(float *src, size_t off, size_t n)
+{ double lo=HUGE_VAL,hi=-HUGE_VAL,elo=HUGE_VAL,ehi=-HUGE_VAL;
+  float nan;
+  size_t i;
+  for(i=0;i<n;++i) src[off+i]=(float)((i*7919)%1000)-500.0f+(float)i/n;
+  nan=(float)HUGE_VAL; nan-=nan;
+  src[off+n/2]=nan;
+  for(i=0;i<n;++i)
+  { if(src[off+i]<elo) elo=src[off+i];
+    if(src[off+i]>ehi) ehi=src[off+i];
+  }
+  kern_f32_range(src+off,n,&lo,&hi);
+  if(lo!=elo || hi!=ehi)
+  { LOG("\trange offset %u n %u: gave [%g,%g], expected [%g,%g]\n",(unsigned)off,(unsigned)n,lo,hi,elo,ehi);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char* argv[])
+{ static const unsigned windows[][2]={{0,65535},{0,256},{100,400},{1000,5000},{30000,31000},{65279,65535}};
+  uint8_t  *dst=0;
+  uint16_t *src=0;
+  float    *f=0;
+  size_t i,off,nbad=0,nrange=0;
+  TRY(dst=(uint8_t*) malloc(N+16));
+  TRY(src=(uint16_t*)malloc(sizeof(*src)*(N+16)));
+  TRY(f=(float*)malloc(sizeof(*f)*(N+16)));
+  for(i=0;i<sizeof(windows)/sizeof(*windows);++i)
+  { const unsigned lo=windows[i][0],hi=windows[i][1];
+    const uint16_t scale=(uint16_t)((256u<<16)/(hi-lo+1)); // as make_window() computes it
+    for(off=0;off<2;++off)
+    { nbad+=check_window(dst,src,off,(uint16_t)lo,scale);
+      TRY(dst[off+hi]==255);   // the top of the window is full scale
+      TRY(dst[off+lo]==0);
+    }
+  }
+  for(off=0;off<2;++off)      // the largest scale, where an unclamped product overflows the signed pack
+    nbad+=check_window(dst,src,off,0,65535);
+  LOG("kern_u16_window: %s\n",nbad?"FAILED":"ok");
+  for(off=0;off<4;++off)      // every alignment of a float row
+    for(i=1;i<40;++i)         // short rows are all tail
+      nrange+=!check_range(f,off,i);
+  nrange+=!check_range(f,1,N);
+  LOG("kern_f32_range: %s\n",nrange?"FAILED":"ok");
+  free(dst);
+  free(src);
+  free(f);
+  return nbad!=0 || nrange!=0;
+Error:
+  free(dst);
+  free(src);
+  free(f);
+  return 1;
+}
@@ -0,0 +1,86 @@
+/**
+ * Round trip of a ramp through the 8-bit intensity window.
+ *
+ * The ramp runs from below the window to well past it, and is written with
+ * and without the Anscombe option.  Read back, every pixel should be near its
+ * value clamped to the window: in particular, everything at or past hi comes
+ * back near hi, not near the mean of the saturated range above it.
+ */
+#include "nd.h"
+#include "ndio-ffmpeg.h"
+#include <stdio.h>  // for printf
+#include <string.h> // for memcpy
+
+#define LOG(...)     printf(__VA_ARGS__)
+#define REPORT(estr) LOG("%s(%d): %s()\n\t%s\n\tEvaluated to false.\n",__FILE__,__LINE__,__FUNCTION__,estr)
+#define TRY(e)       do{if(!(e)){REPORT(#e);goto Error;}}while(0)
+
+#define W    (512)
+#define H    (64)
+#define D    (8)
+#define LO   (1000)
+#define HI   (2000)
+#define STEP (8)          // the ramp reaches W*STEP, about twice HI
+#define TOL  ((HI-LO)/10) // allows for the 8-bit levels and the lossy encode
+#define PATH "window.mp4"
+
+static unsigned short ramp(size_t x) { return (unsigned short)(x*STEP); }
+
+static int clamp(int v) { return v<LO?LO:(v>HI?HI:v); }
+
+/** Writes the ramp through the window, with \a anscombe (or not), reads it back and checks it. */
+static int roundtrip(nd_t a, nd_t b, char *anscombe)
+{ ndio_t f=0;
+  const unsigned short *d;
+  size_t x,i,nbad=0;
+  { ndio_ffmpeg_params_t params;
+    TRY(f=ndioOpen(PATH,"ffmpeg","w"));
+    memcpy(&params,ndioGet(f),sizeof(params));
+    params.window=(char*)"1000,2000";
+    params.anscombe=anscombe;
+    TRY(ndioSet(f,&params,sizeof(params)));
+    TRY(ndioWrite(f,a));
+    ndioClose(f);
+  }
+  TRY(f=ndioOpen(PATH,"ffmpeg","r"));
+  TRY(ndioRead(f,b));
+  ndioClose(f);
+  f=0;
+  d=(const unsigned short*)nddata(b);
+  for(i=0;i<ndnelem(b);++i)
+  { int e;
+    x=i%W;
+    e=(int)d[i]-clamp(ramp(x));
+    if(e<-TOL || e>TOL)
+    { if(!nbad)
+        LOG("\tanscombe=%s: %d read back as %d\n",anscombe?anscombe:"none",(int)ramp(x),(int)d[i]);
+      ++nbad;
+    }
+  }
+  LOG("window%s: %s\n",anscombe?" + anscombe":"",nbad?"FAILED":"ok");
+  return nbad==0;
+Error:
+  ndioClose(f);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{ int eflag=0;
+  nd_t shape=0,a=0,b=0;
+  size_t i;
+  TRY(ndcast(ndreshapev(shape=ndinit(),3,W,H,D),nd_u16));
+  TRY(a=ndheap(shape));
+  TRY(b=ndheap(shape));
+  for(i=0;i<ndnelem(a);++i)
+    ((unsigned short*)nddata(a))[i]=ramp(i%W);
+  if(!roundtrip(a,b,NULL))           eflag=1;
+  if(!roundtrip(a,b,(char*)"1,0,0")) eflag=1;
+Finalize:
+  ndfree(shape);
+  ndfree(a);
+  ndfree(b);
+  return eflag;
+Error:
+  eflag=1;
+  goto Finalize;
+}
@@ -0,0 +1,388 @@
+/**
+ * \file
+ * Pixel kernels used to pack planes for the encoder, unpack decoded frames
+ * and reduce them.
+ *
+ * Each kernel has a portable scalar implementation.  Where SSE2 is available
+ * (all x86-64 targets) the bulk of the row is processed 16 pixels at a time
+ * and the scalar code handles the tail.  Callers may pass any row pointer.
+ * When every pointer a kernel touches is 16-byte aligned, it uses aligned
+ * loads and stores; otherwise unaligned ones.
+ */
+#include "kernels.h"
+#include <math.h> // for HUGE_VAL
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+
+#define ALIGNED(p) ((((uintptr_t)(p))&15)==0)
+
+/* Each SSE2 loop is stamped out twice: with aligned (LD=_mm_load_si128,
+   ST=_mm_store_si128) and unaligned (LD=_mm_loadu_si128, ST=_mm_storeu_si128)
+   accesses.  The kernels pick one per row. */
+
+#define DEFINE_HI(name,LD,ST) \
+  static size_t name(uint8_t *dst, const uint16_t *src, size_t n) \
+  { size_t i=0; \
+    for(;i+16<=n;i+=16) \
+    { __m128i a=_mm_srli_epi16(LD((const __m128i*)(src+i)),8), \
+              b=_mm_srli_epi16(LD((const __m128i*)(src+i+8)),8); \
+      ST((__m128i*)(dst+i),_mm_packus_epi16(a,b)); \
+    } \
+    return i; \
+  }
+DEFINE_HI(hi_a,_mm_load_si128,_mm_store_si128)
+DEFINE_HI(hi_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_LO(name,LD,ST) \
+  static size_t name(uint8_t *dst, const uint16_t *src, size_t n) \
+  { size_t i=0; \
+    const __m128i m=_mm_set1_epi16(0xff); \
+    for(;i+16<=n;i+=16) \
+    { __m128i a=_mm_and_si128(LD((const __m128i*)(src+i)),m), \
+              b=_mm_and_si128(LD((const __m128i*)(src+i+8)),m); \
+      ST((__m128i*)(dst+i),_mm_packus_epi16(a,b)); \
+    } \
+    return i; \
+  }
+DEFINE_LO(lo_a,_mm_load_si128,_mm_store_si128)
+DEFINE_LO(lo_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_MERGE(name,LD,ST) /* interleaving lo,hi bytes yields little-endian u16 */ \
+  static size_t name(uint16_t *dst, const uint8_t *hi, const uint8_t *lo, size_t n) \
+  { size_t i=0; \
+    for(;i+16<=n;i+=16) \
+    { __m128i h=LD((const __m128i*)(hi+i)), \
+              l=LD((const __m128i*)(lo+i)); \
+      ST((__m128i*)(dst+i)  ,_mm_unpacklo_epi8(l,h)); \
+      ST((__m128i*)(dst+i+8),_mm_unpackhi_epi8(l,h)); \
+    } \
+    return i; \
+  }
+DEFINE_MERGE(merge_a,_mm_load_si128,_mm_store_si128)
+DEFINE_MERGE(merge_u,_mm_loadu_si128,_mm_storeu_si128)
+
+/* SSE2 has no unsigned 16-bit min/max, but saturating subtraction gives both:
+   max(a,b)=b+sat(a-b) and min(a,b)=a-sat(a-b). */
+#define MAX_EPU16(a,b) _mm_adds_epu16((b),_mm_subs_epu16((a),(b)))
+#define MIN_EPU16(a,b) _mm_subs_epu16((a),_mm_subs_epu16((a),(b)))
+
+#define DEFINE_WINDOW(name,LD,ST) /* saturating subtract clamps below the window, an unsigned min above it */ \
+  static size_t name(uint8_t *dst, const uint16_t *src, size_t n, uint16_t lo, uint16_t scale) \
+  { size_t i=0; \
+    const __m128i l=_mm_set1_epi16((short)lo), \
+                  s=_mm_set1_epi16((short)scale), \
+                  m=_mm_set1_epi16(255); /* packus is signed: products of 32768 or more would become 0 */ \
+    for(;i+16<=n;i+=16) \
+    { __m128i a=MIN_EPU16(_mm_mulhi_epu16(_mm_subs_epu16(LD((const __m128i*)(src+i))  ,l),s),m), \
+              b=MIN_EPU16(_mm_mulhi_epu16(_mm_subs_epu16(LD((const __m128i*)(src+i+8)),l),s),m); \
+      ST((__m128i*)(dst+i),_mm_packus_epi16(a,b)); \
+    } \
+    return i; \
+  }
+DEFINE_WINDOW(window_a,_mm_load_si128,_mm_store_si128)
+DEFINE_WINDOW(window_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_MAX(name,LD,ST) \
+  static size_t name(uint16_t *acc, const uint16_t *src, size_t n) \
+  { size_t i=0; \
+    for(;i+8<=n;i+=8) \
+      ST((__m128i*)(acc+i),MAX_EPU16(LD((const __m128i*)(acc+i)),LD((const __m128i*)(src+i)))); \
+    return i; \
+  }
+DEFINE_MAX(max_a,_mm_load_si128,_mm_store_si128)
+DEFINE_MAX(max_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_MIN(name,LD,ST) \
+  static size_t name(uint16_t *acc, const uint16_t *src, size_t n) \
+  { size_t i=0; \
+    for(;i+8<=n;i+=8) \
+      ST((__m128i*)(acc+i),MIN_EPU16(LD((const __m128i*)(acc+i)),LD((const __m128i*)(src+i)))); \
+    return i; \
+  }
+DEFINE_MIN(min_a,_mm_load_si128,_mm_store_si128)
+DEFINE_MIN(min_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_SUM(name,LD,ST) /* widen to 32 bits by interleaving with zeros */ \
+  static size_t name(uint32_t *acc, const uint16_t *src, size_t n) \
+  { size_t i=0; \
+    const __m128i z=_mm_setzero_si128(); \
+    for(;i+8<=n;i+=8) \
+    { __m128i v=LD((const __m128i*)(src+i)); \
+      ST((__m128i*)(acc+i)  ,_mm_add_epi32(LD((const __m128i*)(acc+i))  ,_mm_unpacklo_epi16(v,z))); \
+      ST((__m128i*)(acc+i+4),_mm_add_epi32(LD((const __m128i*)(acc+i+4)),_mm_unpackhi_epi16(v,z))); \
+    } \
+    return i; \
+  }
+DEFINE_SUM(sum_a,_mm_load_si128,_mm_store_si128)
+DEFINE_SUM(sum_u,_mm_loadu_si128,_mm_storeu_si128)
+
+#define DEFINE_STATS(name,LD) /* sums low and high bytes separately with SAD, so lanes never overflow */ \
+  static size_t name(const uint16_t *src, size_t n, uint16_t *mn, uint16_t *mx, uint64_t *sum) \
+  { size_t i=0; \
+    const __m128i m=_mm_set1_epi16(0xff),z=_mm_setzero_si128(); \
+    __m128i vmn=_mm_set1_epi16((short)*mn),vmx=_mm_set1_epi16((short)*mx),lo=z,hi=z; \
+    uint16_t t[8]; \
+    uint64_t s[2]; \
+    int j; \
+    for(;i+8<=n;i+=8) \
+    { __m128i v=LD((const __m128i*)(src+i)); \
+      vmn=MIN_EPU16(vmn,v); \
+      vmx=MAX_EPU16(vmx,v); \
+      lo=_mm_add_epi64(lo,_mm_sad_epu8(_mm_and_si128(v,m),z)); \
+      hi=_mm_add_epi64(hi,_mm_sad_epu8(_mm_srli_epi16(v,8),z)); \
+    } \
+    _mm_storeu_si128((__m128i*)t,vmn); for(j=0;j<8;++j) if(t[j]<*mn) *mn=t[j]; \
+    _mm_storeu_si128((__m128i*)t,vmx); for(j=0;j<8;++j) if(t[j]>*mx) *mx=t[j]; \
+    _mm_storeu_si128((__m128i*)s,_mm_add_epi64(lo,_mm_slli_epi64(hi,8))); \
+    *sum+=s[0]+s[1]; \
+    return i; \
+  }
+DEFINE_STATS(stats_a,_mm_load_si128)
+DEFINE_STATS(stats_u,_mm_loadu_si128)
+
+#define DEFINE_F32(name,LD,ST) /* widen to 32 bits, convert, then one multiply-add */ \
+  static size_t name(float *dst, const uint16_t *src, size_t n, float scale, float offset) \
+  { size_t i=0; \
+    const __m128i z=_mm_setzero_si128(); \
+    const __m128  m=_mm_set1_ps(scale),b=_mm_set1_ps(offset); \
+    for(;i+8<=n;i+=8) \
+    { __m128i v=LD((const __m128i*)(src+i)); \
+      ST(dst+i  ,_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v,z)),m),b)); \
+      ST(dst+i+4,_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v,z)),m),b)); \
+    } \
+    return i; \
+  }
+DEFINE_F32(f32_a,_mm_load_si128,_mm_store_ps)
+DEFINE_F32(f32_u,_mm_loadu_si128,_mm_storeu_ps)
+
+/* SSE2 can only pack 32-bit lanes to 16 with signed saturation, so values are
+   biased into the signed range for the pack and flipped back after.  max() is
+   first, so NaN becomes 0. */
+#define QUANT4(v) \
+  _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps((v),o),k),h),z),t)),bias)
+#define DEFINE_QUANT(name,LD,ST) \
+  static size_t name(uint16_t *dst, const float *src, size_t n, float lo, float scale) \
+  { size_t i=0; \
+    const __m128  o=_mm_set1_ps(lo),k=_mm_set1_ps(scale),h=_mm_set1_ps(0.5f), \
+                  z=_mm_setzero_ps(),t=_mm_set1_ps(65535.0f); \
+    const __m128i bias=_mm_set1_epi32(32768),flip=_mm_set1_epi16((short)0x8000); \
+    for(;i+8<=n;i+=8) \
+      ST((__m128i*)(dst+i),_mm_xor_si128(_mm_packs_epi32(QUANT4(LD(src+i)),QUANT4(LD(src+i+4))),flip)); \
+    return i; \
+  }
+DEFINE_QUANT(quant_a,_mm_load_ps,_mm_store_si128)
+DEFINE_QUANT(quant_u,_mm_loadu_ps,_mm_storeu_si128)
+
+/* min/max return their second operand when either is NaN, so with the
+   sample first, NaNs never reach the accumulators. */
+#define DEFINE_RANGE(name,LD) \
+  static size_t name(const float *src, size_t n, double *lo, double *hi) \
+  { size_t i=0; \
+    __m128 vlo=_mm_set1_ps((float)HUGE_VAL),vhi=_mm_set1_ps((float)-HUGE_VAL); \
+    float t[4]; \
+    int j; \
+    for(;i+8<=n;i+=8) \
+    { vlo=_mm_min_ps(LD(src+i+4),_mm_min_ps(LD(src+i),vlo)); \
+      vhi=_mm_max_ps(LD(src+i+4),_mm_max_ps(LD(src+i),vhi)); \
+    } \
+    _mm_storeu_ps(t,vlo); for(j=0;j<4;++j) if(t[j]<*lo) *lo=t[j]; \
+    _mm_storeu_ps(t,vhi); for(j=0;j<4;++j) if(t[j]>*hi) *hi=t[j]; \
+    return i; \
+  }
+DEFINE_RANGE(range_a,_mm_load_ps)
+DEFINE_RANGE(range_u,_mm_loadu_ps)
+#endif
+
+void kern_u16_hi(uint8_t *dst, const uint16_t *src, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(src))?hi_a(dst,src,n):hi_u(dst,src,n);
+#endif
+  for(;i<n;++i)
+    dst[i]=(uint8_t)(src[i]>>8);
+}
+
+void kern_u16_lo(uint8_t *dst, const uint16_t *src, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(src))?lo_a(dst,src,n):lo_u(dst,src,n);
+#endif
+  for(;i<n;++i)
+    dst[i]=(uint8_t)(src[i]&0xff);
+}
+
+void kern_u16_merge(uint16_t *dst, const uint8_t *hi, const uint8_t *lo, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(hi)&&ALIGNED(lo))?merge_a(dst,hi,lo,n):merge_u(dst,hi,lo,n);
+#endif
+  for(;i<n;++i)
+    dst[i]=(uint16_t)((hi[i]<<8)|lo[i]);
+}
+
+void kern_u16_window(uint8_t *dst, const uint16_t *src, size_t n, uint16_t lo, uint16_t scale)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(src))?window_a(dst,src,n,lo,scale):window_u(dst,src,n,lo,scale);
+#endif
+  for(;i<n;++i)
+  { uint32_t v=src[i]>lo?((uint32_t)(src[i]-lo)*scale)>>16:0;
+    dst[i]=(uint8_t)(v>255?255:v);
+  }
+}
+
+void kern_u16_lut(uint8_t *dst, const uint16_t *src, size_t n, const uint8_t *lut)
+{ size_t i=0;
+  for(;i+4<=n;i+=4) // table lookups don't vectorize without gathers, so just unroll
+  { dst[i  ]=lut[src[i  ]];
+    dst[i+1]=lut[src[i+1]];
+    dst[i+2]=lut[src[i+2]];
+    dst[i+3]=lut[src[i+3]];
+  }
+  for(;i<n;++i)
+    dst[i]=lut[src[i]];
+}
+
+void kern_u8_lut16(uint16_t *dst, const uint8_t *src, size_t n, const uint16_t *lut)
+{ size_t i=0;
+  for(;i+4<=n;i+=4)
+  { dst[i  ]=lut[src[i  ]];
+    dst[i+1]=lut[src[i+1]];
+    dst[i+2]=lut[src[i+2]];
+    dst[i+3]=lut[src[i+3]];
+  }
+  for(;i<n;++i)
+    dst[i]=lut[src[i]];
+}
+
+void kern_u16_hist(uint32_t *hist, const uint16_t *src, size_t n)
+{ size_t i;
+  for(i=0;i<n;++i)
+    hist[src[i]]++;
+}
+
+void kern_u16_max(uint16_t *acc, const uint16_t *src, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(acc)&&ALIGNED(src))?max_a(acc,src,n):max_u(acc,src,n);
+#endif
+  for(;i<n;++i)
+    if(src[i]>acc[i]) acc[i]=src[i];
+}
+
+void kern_u16_min(uint16_t *acc, const uint16_t *src, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(acc)&&ALIGNED(src))?min_a(acc,src,n):min_u(acc,src,n);
+#endif
+  for(;i<n;++i)
+    if(src[i]<acc[i]) acc[i]=src[i];
+}
+
+void kern_u16_sum(uint32_t *acc, const uint16_t *src, size_t n)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(acc)&&ALIGNED(src))?sum_a(acc,src,n):sum_u(acc,src,n);
+#endif
+  for(;i<n;++i)
+    acc[i]+=src[i];
+}
+
+void kern_u16_stats(const uint16_t *src, size_t n, uint16_t *mn, uint16_t *mx, uint64_t *sum)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=ALIGNED(src)?stats_a(src,n,mn,mx,sum):stats_u(src,n,mn,mx,sum);
+#endif
+  for(;i<n;++i)
+  { if(src[i]<*mn) *mn=src[i];
+    if(src[i]>*mx) *mx=src[i];
+    *sum+=src[i];
+  }
+}
+
+void kern_u16_f32(float *dst, const uint16_t *src, size_t n, float scale, float offset)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(src))?f32_a(dst,src,n,scale,offset):f32_u(dst,src,n,scale,offset);
+#endif
+  for(;i<n;++i)
+    dst[i]=src[i]*scale+offset;
+}
+
+/** Rounds \a v to u16, clamping.  NaN becomes 0. */
+static uint16_t quant1(double v)
+{ v+=0.5;
+  if(!(v>0.0))    return 0;
+  if(v>65535.0)   return 65535;
+  return (uint16_t)v;
+}
+
+void kern_f32_u16(uint16_t *dst, const float *src, size_t n, float lo, float scale)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=(ALIGNED(dst)&&ALIGNED(src))?quant_a(dst,src,n,lo,scale):quant_u(dst,src,n,lo,scale);
+#endif
+  for(;i<n;++i)
+    dst[i]=quant1((src[i]-lo)*scale);
+}
+
+void kern_f64_u16(uint16_t *dst, const double *src, size_t n, double lo, double scale)
+{ size_t i;
+  for(i=0;i<n;++i)
+    dst[i]=quant1((src[i]-lo)*scale);
+}
+
+void kern_u32_u16(uint16_t *dst, const uint32_t *src, size_t n, double lo, double scale)
+{ size_t i;
+  for(i=0;i<n;++i)
+    dst[i]=quant1((src[i]-lo)*scale);
+}
+
+void kern_u64_u16(uint16_t *dst, const uint64_t *src, size_t n, double lo, double scale)
+{ size_t i;
+  for(i=0;i<n;++i)
+    dst[i]=quant1(((double)src[i]-lo)*scale);
+}
+
+void kern_f32_range(const float *src, size_t n, double *lo, double *hi)
+{ size_t i=0;
+#ifdef HAVE_SSE2
+  i=ALIGNED(src)?range_a(src,n,lo,hi):range_u(src,n,lo,hi);
+#endif
+  for(;i<n;++i)
+  { if(src[i]<*lo) *lo=src[i];
+    if(src[i]>*hi) *hi=src[i];
+  }
+}
+
+void kern_f64_range(const double *src, size_t n, double *lo, double *hi)
+{ size_t i;
+  for(i=0;i<n;++i)
+  { if(src[i]<*lo) *lo=src[i];
+    if(src[i]>*hi) *hi=src[i];
+  }
+}
+
+void kern_u32_range(const uint32_t *src, size_t n, double *lo, double *hi)
+{ uint32_t mn=0xffffffffu,mx=0;
+  size_t i;
+  for(i=0;i<n;++i) // integer compares vectorize; converting each sample to double wouldn't
+  { if(src[i]<mn) mn=src[i];
+    if(src[i]>mx) mx=src[i];
+  }
+  if(n && mn<*lo) *lo=mn;
+  if(n && mx>*hi) *hi=mx;
+}
+
+void kern_u64_range(const uint64_t *src, size_t n, double *lo, double *hi)
+{ uint64_t mn=~(uint64_t)0,mx=0;
+  size_t i;
+  for(i=0;i<n;++i)
+  { if(src[i]<mn) mn=src[i];
+    if(src[i]>mx) mx=src[i];
+  }
+  if(n && (double)mn<*lo) *lo=(double)mn;
+  if(n && (double)mx>*hi) *hi=(double)mx;
+}
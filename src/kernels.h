@@ -0,0 +1,29 @@
+#pragma once
+/** \file
+ *  Pixel kernels used to pack planes for the encoder, unpack decoded frames
+ *  and reduce them.
+ *  Each kernel processes one row of \a n pixels.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+void kern_u16_hi(uint8_t *dst, const uint16_t *src, size_t n);                ///< dst[i]=src[i]>>8
+void kern_u16_lo(uint8_t *dst, const uint16_t *src, size_t n);                ///< dst[i]=src[i]&0xff
+void kern_u16_merge(uint16_t *dst, const uint8_t *hi, const uint8_t *lo, size_t n); ///< dst[i]=(hi[i]<<8)|lo[i]
+void kern_u16_window(uint8_t *dst, const uint16_t *src, size_t n, uint16_t lo, uint16_t scale); ///< dst[i]=min(255,(max(src[i]-lo,0)*scale)>>16)
+void kern_u16_lut(uint8_t *dst, const uint16_t *src, size_t n, const uint8_t *lut);         ///< dst[i]=lut[src[i]] (lut has 65536 entries)
+void kern_u8_lut16(uint16_t *dst, const uint8_t *src, size_t n, const uint16_t *lut);       ///< dst[i]=lut[src[i]] (lut has 256 entries)
+void kern_u16_hist(uint32_t *hist, const uint16_t *src, size_t n);                          ///< hist[src[i]]++ (hist has 65536 bins)
+void kern_u16_max(uint16_t *acc, const uint16_t *src, size_t n);                            ///< acc[i]=max(acc[i],src[i])
+void kern_u16_min(uint16_t *acc, const uint16_t *src, size_t n);                            ///< acc[i]=min(acc[i],src[i])
+void kern_u16_sum(uint32_t *acc, const uint16_t *src, size_t n);                            ///< acc[i]+=src[i]
+void kern_u16_stats(const uint16_t *src, size_t n, uint16_t *mn, uint16_t *mx, uint64_t *sum); ///< Folds src into the running *mn, *mx and *sum
+void kern_u16_f32(float *dst, const uint16_t *src, size_t n, float scale, float offset);    ///< dst[i]=src[i]*scale+offset
+void kern_f32_u16(uint16_t *dst, const float *src, size_t n, float lo, float scale);        ///< dst[i]=(src[i]-lo)*scale, rounded and clamped to 0..65535.  NaN gives 0.
+void kern_f64_u16(uint16_t *dst, const double *src, size_t n, double lo, double scale);     ///< As kern_f32_u16()
+void kern_u32_u16(uint16_t *dst, const uint32_t *src, size_t n, double lo, double scale);   ///< As kern_f32_u16()
+void kern_u64_u16(uint16_t *dst, const uint64_t *src, size_t n, double lo, double scale);   ///< As kern_f32_u16()
+void kern_f32_range(const float *src, size_t n, double *lo, double *hi);                    ///< Folds src into the running *lo and *hi.  NaNs are skipped.
+void kern_f64_range(const double *src, size_t n, double *lo, double *hi);                   ///< As kern_f32_range()
+void kern_u32_range(const uint32_t *src, size_t n, double *lo, double *hi);                 ///< As kern_f32_range()
+void kern_u64_range(const uint64_t *src, size_t n, double *lo, double *hi);                 ///< As kern_f32_range()
@@ -24,11 +24,12 @@
     \todo convert more formats to a writable form.  Favor writing something approximate over not
           writing anything at all.
     \todo probabaly have to do a copy for some conversions.
-    \todo handle options
 
     Reader
     ------
-    \todo what to do with multiple video streams?
+    Several video streams (see ndio_ffmpeg_params_t::streams) are read as the
+    channels of one array.  The file is demuxed once; packets are queued per
+    stream and each stream's decoder runs on its own thread.
     \todo Channel ordering on read is different than channel ordering required for write, which
           is awkward.
     \todo for appropriate 1d data, use audio streams
@@ -54,25 +55,129 @@
           use.  Some of the current examples use depricated APIs.
           * The process of read/writing a container file is called demuxing/muxing.
           * The process of unpacking/packing a video stream is called decoding/encoding.
+
+    \section ndio-ffmpeg-profiles Encoding profiles
+
+    Reading frame i means decoding from the keyframe before it, so the GOP
+    structure trades file size against the cost of a seek.  Set
+    ndio_ffmpeg_params_t::profile to pick one:
+
+        profile        GOP            B-frames               frames decoded/seek   size
+        -------        ---            --------               -------------------   ----
+        archive        250            3, pyramid, 4 refs     ~125                  smallest
+        random-access  8, closed      2, no pyramid, 1 ref   ~4                    larger
+        intra          1              none                   1                     largest
+
+    app/bench/seekcost.c measures both sides of the trade-off for a sample of
+    your data.  For lossless (FFV1) output every frame is a keyframe and the
+    profile has no effect.
+
+    \section ndio-ffmpeg-parts 5D arrays
+
+    A w,h,d,c,t array is stored as c*t w,h,d volumes ("parts").  Part (0,0) is
+    the file itself, which also records c and t in the plugin metadata as
+    parts=c,t.  Part (c,t) is the file next to it named "name.c<c>.t<t>.ext".
+    Each write adds its time points after those already written, so a
+    time-lapse can be written one time point at a time.  Every write must have
+    the same w,h,d and c.  The parts are encoded in parallel, and each part's
+    encoders only exist while it is being written.  Containers that write tags
+    only in the header (mkv, nut) record the time points of the first write,
+    so readers also count the parts found next to the file.  Reading a (c,t)
+    slice opens just that part; reading the whole array decodes the parts in
+    parallel.
+
+    \section ndio-ffmpeg-tiles Tiles
+
+    With ndio_ffmpeg_params_t::tile, each plane is cut into tiles, numbered
+    in row-major order, and tile k is encoded as stream k.  The plugin
+    metadata records tiles=W,H,tw,th (plane size, tile size).  A reader given
+    ndio_ffmpeg_params_t::roi decodes only the streams of the tiles the
+    region touches, concurrently, so the cost of a read scales with the
+    region rather than the plane.
+
+    The region is chosen when the file is opened.  Subarray reads still seek
+    only along z, so reading another region means opening the file again with
+    another roi.  The skipped tiles' packets are still read from disk and
+    dropped by the demuxer; only their decoding is saved.
+
+    \section ndio-ffmpeg-append Appending
+
+    Each ndioWrite() to an open file appends its planes to the stream, so
+    planes that arrive over time are best written through one writer left
+    open.  Mode "a" reopens a closed file written by this plugin.  nut and
+    mp4 files written with ndio_ffmpeg_params_t::fragment are made of
+    self-contained pieces, so they are extended in place: the new planes
+    just follow the old ones.  Other finished containers can't be extended
+    in place, so the existing packets are stream-copied (not decoded) into
+    a new file that replaces the old one on close.  That copy is
+    proportional to the file, not to the new planes, and needs as much free
+    space again.  Either way the new encoders must produce the stream
+    header already in the file, byte for byte, or the open fails.
+
+    \section ndio-ffmpeg-f32 Float output
+
+    Planes come back as u16, or, when the destination is nd_f32, as
+    x*scale+offset (see ndio_ffmpeg_params_t::scale).  Each plane is decoded
+    into a one-plane u16 scratch and scaled into the destination row by row,
+    so there is no volume-sized u16 copy and no second pass over the volume.
+    Writers may record the constants (norm=scale,offset in the plugin
+    metadata) so readers normalize each file the same way.
+
+    Float and 32/64-bit arrays are written by quantizing them to u16 (see
+    ndio_ffmpeg_params_t::quantize).  Each encoder quantizes the rows it
+    reads into a one-plane scratch just before packing them, so there is
+    no converted copy of the volume.  The inverse mapping is recorded as
+    norm, or as norm_planes=scale:offset,... for per-plane ranges, so an
+    f32 read returns approximately the values written.
+
+    \section ndio-ffmpeg-reduce Reductions
+
+    With ndio_ffmpeg_params_t::reduce set, ndioRead() decodes the file plane
+    by plane into the caller's one-plane array and folds each plane into the
+    projections, per-plane statistics and histogram asked for (see
+    ndio_ffmpeg_reduce_t) before decoding the next.  Memory use is one plane
+    plus the outputs, whatever the length of the file.
+
+    ndio_ffmpeg_params_t::stream generalizes this to any per-plane work.
+    ndioRead() decodes on the calling thread into a ring of plane buffers;
+    worker threads take the planes in order, hand each to the caller's
+    callback and return the buffer to the ring.  The decoder waits when the
+    ring is full, so at most ndio_ffmpeg_stream_t::depth planes are in
+    memory and decoding overlaps with the callbacks.
+    With ndio_ffmpeg_stream_t::native, the callback gets the decoder's own
+    planes instead, without conversion or copying, but on the decoding
+    thread, since the decoder reuses its buffers.
+
+    ndio_ffmpeg_params_t::source runs the same ring the other way for
+    writes: workers fill planes on demand and ndioWrite() encodes them in
+    order.
 */
 #include "strsep.h"
+#include "thread.h"
+#include "kernels.h"
 #include "nd.h"
 #include "src/io/interface.h"
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include "ndio-ffmpeg.h"
 
 // need to define inline before including av* headers on C89 compilers
 #ifdef _MSC_VER
 #define inline __forceinline
+#define vsnprintf _vsnprintf
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // for MoveFileEx
 #endif
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/opt.h"
+#include "libavutil/avstring.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/time.h"
 
 /// @cond DEFINES
 #define countof(e)        (sizeof(e)/sizeof(*e))
@@ -99,10 +204,52 @@ static const AVRational FREQ = {1,AV_TIME_BASE}; // same as AV_TIME_BASE_Q, but
 #define STREAM(e)   ((e)->fmt->streams[(e)->istream])
 #define CCTX(e)     ((e)->fmt->streams[(e)->istream]->codec)    ///< gets the AVCodecContext for the selected video stream
 #define DURATION(e) (av_rescale_q((e)->fmt->duration,av_mul_q(FREQ,STREAM(e)->r_frame_rate),ONE)) ///< gets the duration in #frames
+#define FOLLOW_POLL_USEC 10000 ///< How often follow mode checks a growing file for new frames
+#define FRAME_ALIGN      64    ///< Alignment of frame buffers and their line strides.  A cache line; also enough for any SIMD width swscale and the kernels use.
+#define MIN_SWS_WIDTH    8     ///< swscale refuses narrower destinations
 /// @endcond
 
 static int is_one_time_inited = 0; /// Tracks whether avcodec has been init'd.  \todo should be mutexed
 
+/** Which part of each source plane an encoder receives. */
+enum
+{ ENC_ALL=0, ///< the whole plane, converted with swscale
+  ENC_HI,    ///< the high byte of each u16 pixel
+  ENC_LO,    ///< the low byte of each u16 pixel
+  ENC_LUT    ///< u16 pixels mapped to 8 bits through an intensity window or table
+};
+
+/** Per-stream encoder state (for writing). */
+typedef struct _ndio_ffmpeg_enc_t
+{ int                istream; ///< The output stream index
+  int                role;    ///< What this stream holds. One of ENC_ALL, ENC_HI, ENC_LO or ENC_LUT.
+  int                width;   ///< Encoded frame width (may be padded)
+  int                height;  ///< Encoded frame height (may be padded)
+  int                src_w;   ///< Source plane width
+  int                src_h;   ///< Source plane height
+  int                src_pixfmt; ///< Source plane pixel format
+  int                channel; ///< Source channel this encoder reads.  Nonzero only for channel streams.
+  int                x0,y0;   ///< Origin in the source plane of the tile this encoder reads.  Nonzero only for tiles.
+  int64_t            pts;     ///< Presentation time of the next frame
+  AVCodecContext    *cctx;    ///< The encoder.  The stream's codec context, except for segment encoders which own theirs.
+  AVDictionary      *optsave; ///< Copy of the options the encoder was opened with.  Used to open segment encoders the same way.
+  struct SwsContext *sws;     ///< Converts source planes to the encoder's pixel format. NULL when planes are packed directly.
+  AVFrame           *raw;     ///< The encoder's input frame
+  AVDictionary      *opts;    ///< for codec private options
+  uint8_t           *lut;     ///< For ENC_LUT, the 65536-entry u16 to u8 table.  NULL when the linear window below is used.
+  uint16_t           win_lo;  ///< For ENC_LUT without a table: the bottom of the window
+  uint16_t           win_scale; ///< For ENC_LUT without a table: 256/(hi-lo+1) in 16-bit fixed point
+} enc_t;
+
+/** Per-stream packet queue (for reading).
+    Packets demuxed while looking for another stream's packets wait here.
+ */
+typedef struct _ndio_ffmpeg_pktq_t
+{ AVPacketList      *head,*tail;
+  AVPacket           last;    ///< The packet most recently handed to the decoder.  Rawvideo frames reference its data.
+  int                wanted;  ///< Nonzero if packets for this stream are kept.
+} pktq_t;
+
 /** File context used for operating on video files with FFMPEG */
 typedef struct _ndio_ffmpeg_t
 { AVFormatContext   *fmt;     ///< The main handle to the open file
@@ -111,7 +258,52 @@ typedef struct _ndio_ffmpeg_t
   int                istream; ///< The stream index.
   int64_t            nframes; ///< Duration of video in frames (for reading)
   int64_t            iframe;  ///< the last requested frame (for seeking)
-  AVDictionary      *opts;    ///< for codec private options
+  AVDictionary      *opts;    ///< for muxer private options
+  AVDictionary      *decopts; ///< the caller's decoder options (for reading)
+  AVDictionary      *meta;    ///< Plugin metadata stored in the container (see meta_write() and meta_read())
+  enc_t             *enc;     ///< Encoders, one per output stream (for writing)
+  int                nenc;    ///< Number of encoders
+  mutex_t            mux;     ///< Serializes access to the muxer when encoders run concurrently
+  pktq_t            *q;       ///< Packet queues, one per stream (for reading)
+  int                lo;      ///< For split16 files, the low-byte stream index. Otherwise -1. (for reading)
+  AVFrame           *lo_raw;  ///< Decoded low-byte frame for split16 files.
+  uint16_t          *inv;     ///< For files written through an intensity window, the 256-entry table back to u16. (for reading)
+  int64_t            frag_frames; ///< Flush the output every this many frames.  0 disables. (for writing)
+  int64_t            frag_usec;   ///< Flush the output every this many microseconds.  0 disables. (for writing)
+  int64_t            frag_n;      ///< Frames muxed since the last flush
+  int64_t            frag_t;      ///< Time of the last flush (see av_gettime())
+  AVFormatContext   *scout;       ///< Follow mode: a second demuxer that reads ahead counting frames as they arrive. (for reading)
+  int64_t            follow_usec; ///< Follow mode: how long to wait for more of the file.
+  int64_t            target;      ///< Follow mode: the frame decode_to() is after.  End of file before it means wait, not flush.
+  char              *path;        ///< The file's path.  In append mode, the file being extended, replaced by \a tmp on close.
+  char              *tmp;         ///< Append mode: where the extended file is written.
+  int64_t           *base;        ///< Append mode: frames already in each stream.  New frames continue from here.
+  int                chunk;       ///< Force a keyframe every this many planes, or at every write if -1. (for writing)
+  int                nshares;     ///< Number of codec contexts counted against the process-wide thread budget
+  int                dec_threads; ///< Decoder threads, or 0 to use the budget. (for reading)
+  int                dec_type;    ///< Decoder FF_THREAD_* flags, or 0 for the default. (for reading)
+  int                w;           ///< Width of the frames returned.  The written width, without the padding to even. (for reading)
+  int                h;           ///< Height of the frames returned.  The written height, without the padding to even. (for reading)
+  AVFrame           *stage;       ///< The frame converted at full width, for regions narrower than \a cw.  Allocated on first use. (for reading)
+  int               *ch;          ///< Channel streams: the stream holding each channel.  ch[0] is \a istream. (for reading)
+  int                nch;         ///< Number of channel streams, or 0 for other files.
+  AVFrame          **ch_raw;      ///< Decoded frame for each channel stream.  ch_raw[0] is \a raw.
+  struct SwsContext **ch_sws;     ///< Conversion for each channel stream, so channels convert concurrently.  ch_sws[0] is \a sws.
+  int                pc,pt;       ///< 5D files: the number of channels and time points, each a w,h,d part (see \ref ndio-ffmpeg-parts).  0 otherwise.
+  ndio_t            *parts;       ///< 5D files, reading: handles on the part files, indexed c+pc*t.  parts[0] is unused; part 0 is this file.  Only the last one used is kept open.
+  int                ipart;       ///< 5D files: the part open for reading, or 0 if none. (for reading)
+  int                pw,ph;       ///< Tiled files: the plane size (see \ref ndio-ffmpeg-tiles).  0 otherwise. (for reading)
+  int                tw,th,tcols; ///< Tiled files: the tile size and the number of tile columns.
+  int                rx,ry;       ///< The origin of the region read (see ndio_ffmpeg_params_t::roi).  \a w and \a h are its size.
+  int                cx,cw;       ///< The columns converted: the region's, widened if needed to what swscale accepts.
+  int                roi;         ///< Nonzero if the caller asked for a region.  The shape is then never packed.
+  AVFrame          **ch_stage;    ///< Each stream in the output pixel format, before it's cropped to the region.  Allocated for tiles, and for regions narrower than \a cw.
+  float              scale,offset; ///< Reading into f32 arrays: values are returned as x*scale+offset (see ndio_ffmpeg_params_t::scale).
+  nd_t               u16;         ///< Reading into f32 arrays: the u16 plane decoded before scaling.  Allocated on first use.
+  float             *norm;        ///< Reading into f32 arrays: per-plane scale,offset pairs recorded by a writer that quantized each plane on its own, or NULL.
+  int64_t            nnorm;       ///< Number of pairs in \a norm
+  int                qmode;       ///< Writing float or 32/64-bit data: 0 before the first write, 1 for one mapping to u16 (\a qlo, \a qk), 2 for per-plane mappings.
+  double             qlo,qk;      ///< Writing: samples x are stored as (x-qlo)*qk (see ndio_ffmpeg_params_t::quantize).
 } *ndio_ffmpeg_t;
 
 //
@@ -121,6 +313,22 @@ typedef struct _ndio_ffmpeg_t
 /** returns x if x is even, otherwise x+1 */
 int even(int x) { if (x%2) return x+1; return x; }
 
+/** \returns the path of part (c,t) of the 5D file at \a path: "name.c<c>.t<t>.ext".  The caller frees it. */
+static char* part_path(const char *path, int c, int t)
+{ const char *dot=strrchr(path,'.'),
+             *sep=strrchr(path,'/');
+  size_t n;
+  char *out;
+  if(!dot || (sep && sep>dot) || (strrchr(path,'\\') && strrchr(path,'\\')>dot))
+    dot=path+strlen(path);
+  n=dot-path;
+  if(!(out=(char*)malloc(n+strlen(dot)+32)))
+    return 0;
+  memcpy(out,path,n);
+  sprintf(out+n,".c%d.t%d%s",c,t,dot);
+  return out;
+}
+
 /** One-time initialization for ffmpeg library.
 
     This gets called by ndio_get_format_api(), so it's guaranteed to be called
@@ -204,6 +412,83 @@ enum PixelFormat pixfmt_to_output_pixfmt(int pxfmt)
 { return PIX_FMT_GRAY16;
 }
 
+/** Picks the encoder's pixel format.
+    Lossless (FFV1) encoders get \a src_pixfmt when they accept it, so no
+    precision is lost in the conversion (e.g. GRAY16).  Every other encoder
+    gets its first choice, as it always has (yuv420p for x264), so lossy
+    output is unchanged.
+ */
+static enum PixelFormat choose_pixfmt(const AVCodec *codec, int src_pixfmt)
+{ const enum PixelFormat *p;
+  if(!codec->pix_fmts) return PIX_FMT_NONE;
+  if(codec->id==CODEC_ID_FFV1)
+    for(p=codec->pix_fmts;*p!=PIX_FMT_NONE;++p)
+      if(*p==src_pixfmt)
+        return *p;
+  return codec->pix_fmts[0];
+}
+
+/** \returns the smallest number of slices, at least \a n, that FFV1 version 3 will accept.
+    FFV1 wants the slices arranged in a h x v grid with v<=h<2v and at most 64 slices.
+ */
+static int ffv1_slices(int n)
+{ int v,h,best=64;
+  for(v=2;v<9;++v)
+    for(h=v;h<2*v;++h)
+      if(h*v>=n && h*v<best)
+        best=h*v;
+  return best;
+}
+
+/** \returns true if \a pxfmt keeps 8-bit luma in its first plane.
+    Gray planes can then be copied straight into the encoder's frame without
+    swscale's range conversion, which keeps them exact.
+ */
+static int is_luma8(int pxfmt)
+{ const AVPixFmtDescriptor *d=av_pix_fmt_descriptors+pxfmt;
+  if(d->flags&(PIX_FMT_RGB|PIX_FMT_PAL|PIX_FMT_BITSTREAM|PIX_FMT_HWACCEL))
+    return 0;
+  if(d->nb_components!=1 && !(d->nb_components==3 && (d->flags&PIX_FMT_PLANAR)))
+    return 0;
+  return d->comp[0].plane==0 && d->comp[0].depth_minus1==7 && d->comp[0].step_minus1==0;
+}
+
+/** Pads a frame holding a \a w by \a h picture out to the \a W by \a H it's
+    encoded at, by repeating the last column and row of each plane.
+    Much cheaper than resampling, and the reader crops the padding off again.
+ */
+static void pad_frame(AVFrame *f, int pxfmt, int w, int h, int W, int H)
+{ const AVPixFmtDescriptor *desc=av_pix_fmt_descriptors+pxfmt;
+  int lw[4]={0},lW[4]={0},i,y;
+  if(w==W && h==H)
+    return;
+  av_image_fill_linesizes(lw,pxfmt,w);
+  av_image_fill_linesizes(lW,pxfmt,W);
+  for(i=0;i<4 && f->data[i];++i)
+  { const int s=(i==1||i==2)?desc->log2_chroma_h:0,
+              ph=-((-h)>>s),
+              pH=-((-H)>>s),
+              n=lW[i]-lw[i]; // bytes of padding per row.  0 for subsampled planes that already cover it.
+    if(n>0 && lw[i]>=n)
+      for(y=0;y<ph;++y)
+      { uint8_t *r=f->data[i]+f->linesize[i]*y;
+        memcpy(r+lw[i],r+lw[i]-n,n);
+      }
+    for(y=ph;y<pH;++y)
+      memcpy(f->data[i]+f->linesize[i]*y,f->data[i]+f->linesize[i]*(ph-1),lW[i]);
+  }
+}
+
+/** Sets the chroma planes of a frame allocated for \a pxfmt to neutral gray. */
+static void neutral_chroma(AVFrame *f, int pxfmt, int height)
+{ const AVPixFmtDescriptor *d=av_pix_fmt_descriptors+pxfmt;
+  int j,h=-((-height)>>d->log2_chroma_h);
+  for(j=1;j<3;++j)
+    if(f->data[j])
+      memset(f->data[j],128,f->linesize[j]*h);
+}
+
+
 /* OLD - this was a bad idea -- trying to infer output pixel type from encoded type.
          Really need a way to change this as an option.
          TODO: API for setting decode pixel type
@@ -248,6 +533,164 @@ Error:
   goto Finalize;
 }
 
+//
+//  === METADATA ===
+//
+//  Plugin metadata is a list of key/value pairs serialized into the container's
+//  comment tag as "ndio-ffmpeg;key=value;key=value".  The comment tag is one
+//  that every container we write (mp4,mkv,nut,avi,ogg) round-trips.
+//
+
+/// @cond DEFINES
+#define META_TAG "comment"
+#define META_ID  "ndio-ffmpeg"
+/// @endcond
+
+/** Records a plugin metadata value.  It is stored by the next meta_write(). */
+static int meta_set(ndio_ffmpeg_t self, const char *key, const char *value)
+{ return av_dict_set(&self->meta,key,value,0)>=0;
+}
+
+/** printf-style meta_set(). */
+static int meta_setf(ndio_ffmpeg_t self, const char *key, const char *fmt, ...)
+{ char buf[1024];
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(buf,sizeof(buf),fmt,ap);
+  va_end(ap);
+  buf[sizeof(buf)-1]=0;
+  return meta_set(self,key,buf);
+}
+
+/** \returns the plugin metadata value for \a key, or NULL if it isn't present. */
+static const char* meta_get(ndio_ffmpeg_t self, const char *key)
+{ AVDictionaryEntry *e=av_dict_get(self->meta,key,NULL,0);
+  return e?e->value:NULL;
+}
+
+/** For ndio_ffmpeg_params_t::chunk<0: records that a write starts at frame
+    \a pts, so readers needn't scan for keyframes (see chunk_starts()).  The
+    chunk key becomes "write:i0,i1,...".  A plain "write" that didn't start at
+    frame 0 (an append to a file whose container kept only the header's tags)
+    is left alone, since the earlier starts are unknown.
+ */
+static int meta_note_write(ndio_ffmpeg_t self, int64_t pts)
+{ const char *v=meta_get(self,"chunk");
+  char *s;
+  if(!v || strncmp(v,"write",5))
+    return 1;
+  if(v[5]==':')
+    s=av_asprintf("%s,%lld",v,(long long)pts);
+  else if(pts==0)
+    s=av_asprintf("write:%lld",(long long)pts);
+  else
+    return 1;
+  TRY(s);
+  TRY(av_dict_set(&self->meta,"chunk",s,AV_DICT_DONT_STRDUP_VAL)>=0);
+  return 1;
+Error:
+  return 0;
+}
+
+//
+//  === OPTIONS ===
+//
+
+/** Parses the caller's "key=value;key=value" options from \a s into \a opts.
+    Later keys replace earlier ones.  A NULL \a s adds nothing.
+ */
+static int parse_options(AVDictionary **opts, const char *s)
+{ char *copy=0,*bookmark,*token;
+  if(!s)
+    return 1;
+  TRY(copy=bookmark=strdup(s));
+  while((token=strsep(&bookmark,";"))!=NULL)
+  { char *v=strchr(token,'=');
+    if(!*token)
+      continue;
+    if(!v)
+    { LOG("ndio-ffmpeg: Expected key=value in options, but got \"%s\"."ENDL,token);
+      goto Error;
+    }
+    *v++=0;
+    TRY(av_dict_set(opts,token,v,0)>=0);
+  }
+  free(copy);
+  return 1;
+Error:
+  if(copy) free(copy);
+  return 0;
+}
+
+/** Checks that every key in \a user was consumed.
+    \a left holds what an open function didn't recognize.  Keys the plugin
+    set itself may be left over without complaint.
+    \param[in] what  Names the kind of option in the error message.
+    \returns 1 if all the caller's keys were used, otherwise 0.
+ */
+static int check_options(AVDictionary *user, AVDictionary *left, const char *what)
+{ AVDictionaryEntry *e=0;
+  int ok=1;
+  while((e=av_dict_get(left,"",e,AV_DICT_IGNORE_SUFFIX)))
+    if(av_dict_get(user,e->key,NULL,0))
+    { LOG("ndio-ffmpeg: Unknown %s option \"%s\"."ENDL,what,e->key);
+      ok=0;
+    }
+  return ok;
+}
+
+/** Serializes the plugin metadata into the output container's comment tag.
+    Must be called before avformat_write_header() (and again before
+    av_write_trailer() for containers that write tags at the end).
+    The tag is written even with no metadata, so append mode can tell the
+    plugin's files from others.
+ */
+static int meta_write(ndio_ffmpeg_t self)
+{ AVDictionaryEntry *e=0;
+  size_t n=sizeof(META_ID);
+  char *buf=0;
+  while((e=av_dict_get(self->meta,"",e,AV_DICT_IGNORE_SUFFIX)))
+    n+=strlen(e->key)+strlen(e->value)+2;
+  TRY(buf=(char*)malloc(n));
+  strcpy(buf,META_ID);
+  while((e=av_dict_get(self->meta,"",e,AV_DICT_IGNORE_SUFFIX)))
+  { strcat(buf,";");
+    strcat(buf,e->key);
+    strcat(buf,"=");
+    strcat(buf,e->value);
+  }
+  TRY(av_dict_set(&self->fmt->metadata,META_TAG,buf,0)>=0);
+  free(buf);
+  return 1;
+Error:
+  if(buf) free(buf);
+  return 0;
+}
+
+/** Parses plugin metadata from the comment tag of the input container \a fmt.
+    A missing or foreign comment is not an error; it just yields no metadata.
+ */
+static int meta_read(ndio_ffmpeg_t self, AVFormatContext *fmt)
+{ AVDictionaryEntry *e;
+  char *copy=0,*bookmark,*token;
+  if(!(e=av_dict_get(fmt->metadata,META_TAG,NULL,0)))
+    return 1;
+  TRY(copy=bookmark=strdup(e->value));
+  token=strsep(&bookmark,";");
+  if(token && streq(token,META_ID))
+    while((token=strsep(&bookmark,";"))!=NULL)
+    { char *v=strchr(token,'=');
+      if(!v) continue;
+      *v++=0;
+      TRY(meta_set(self,token,v));
+    }
+  free(copy);
+  return 1;
+Error:
+  if(copy) free(copy);
+  return 0;
+}
+
 /**
  * Just does matching of the extension to a format shortname registered with ffmpeg.
  * \returns true if the file is readible using this interface.
@@ -304,46 +747,645 @@ static unsigned is_ffmpeg(const char *path, const char *mode)
   switch(mode[0])
   { case 'r': return test_readable(path);
     case 'w': return test_writable(path);
+    case 'a': return test_writable(path) && (avio_check(path,AVIO_FLAG_READ)<0 || test_readable(path));
     default:
       ;
   }
   return 0;
 }
 
+/** Releases decoder-side resources.  Used by open_reader() and close_ffmpeg(). */
+static void release_reader(ndio_ffmpeg_t self)
+{ if(self->fmt)
+  { unsigned i;
+    if(self->q)
+    { for(i=0;i<self->fmt->nb_streams;++i)
+      { AVPacketList *e,*n;
+        for(e=self->q[i].head;e;e=n)
+        { n=e->next;
+          av_free_packet(&e->pkt);
+          av_free(e);
+        }
+        av_free_packet(&self->q[i].last);
+      }
+      free(self->q);
+    }
+    if(self->fmt->nb_streams && CCTX(self)) avcodec_close(CCTX(self));
+    if(self->lo>=0) avcodec_close(self->fmt->streams[self->lo]->codec);
+    for(i=1;i<(unsigned)self->nch;++i)
+      avcodec_close(self->fmt->streams[self->ch[i]]->codec);
+    avformat_close_input(&self->fmt);
+  }
+  { int k;
+    for(k=0;k<self->nch;++k)
+    { if(self->ch_raw && self->ch_raw[k] && self->ch_raw[k]!=self->raw) av_free(self->ch_raw[k]);
+      if(self->ch_sws && self->ch_sws[k] && self->ch_sws[k]!=self->sws) sws_freeContext(self->ch_sws[k]);
+      if(self->ch_stage && self->ch_stage[k])
+      { av_freep(&self->ch_stage[k]->data[0]);
+        av_free(self->ch_stage[k]);
+      }
+    }
+  }
+  SAFEFREE(self->ch);
+  SAFEFREE(self->ch_raw);
+  SAFEFREE(self->ch_sws);
+  SAFEFREE(self->ch_stage);
+  if(self->scout)  avformat_close_input(&self->scout);
+  if(self->lo_raw) av_free(self->lo_raw);
+  if(self->inv)    free(self->inv);
+}
+
+/** Drops any queued packets and resets the decoders.  Call after seeking. */
+static void reset_queues(ndio_ffmpeg_t self)
+{ unsigned i;
+  for(i=0;i<self->fmt->nb_streams;++i)
+  { AVPacketList *e,*n;
+    for(e=self->q[i].head;e;e=n)
+    { n=e->next;
+      av_free_packet(&e->pkt);
+      av_free(e);
+    }
+    self->q[i].head=self->q[i].tail=0;
+  }
+  avcodec_flush_buffers(CCTX(self));
+  if(self->lo>=0)
+    avcodec_flush_buffers(self->fmt->streams[self->lo]->codec);
+  for(i=1;i<(unsigned)self->nch;++i)
+    avcodec_flush_buffers(self->fmt->streams[self->ch[i]]->codec);
+}
+
+/** Takes the frame count from the container when it can be trusted, so the
+    packets needn't be counted.  The stream's own count (nb_frames) is used
+    when there is one.  It can differ from the count derived from the duration
+    by a frame or two (B-frames, edit lists) without anything being wrong.
+    Files written with ndio_ffmpeg_params_t::fragment (the fragment key) may
+    have been left unfinished, so for them a disagreement means a stale header
+    and the packets are counted.  The duration alone can't be trusted if it's
+    missing, or a guess from the bit rate (a file that was never closed has no index).
+    \returns 1 if self->nframes is settled, 0 if the packets must be counted.
+ */
+static int container_frames(ndio_ffmpeg_t self)
+{ const AVStream *st=STREAM(self);
+  if(st->nb_frames>0)
+  { if(meta_get(self,"fragment") && st->nb_frames!=self->nframes)
+      return 0;
+    self->nframes=st->nb_frames;
+    return 1;
+  }
+  if(self->fmt->duration==AV_NOPTS_VALUE || self->nframes<=0)
+    return 0;
+  if(self->fmt->duration_estimation_method==AVFMT_DURATION_FROM_BITRATE)
+    return 0;
+  return 1;
+}
+
+/** Counts the frames in the main stream by reading every packet, then rewinds.
+    Used when the container's duration can't be trusted, e.g. for a fragmented
+    file that is still being written or was never closed.
+ */
+static void count_frames(ndio_ffmpeg_t self)
+{ AVPacket p={0};
+  int64_t n=0;
+  av_init_packet(&p);
+  while(av_read_frame(self->fmt,&p)>=0)
+  { if(p.stream_index==self->istream)
+      ++n;
+    av_free_packet(&p);
+  }
+  self->nframes=n;
+  av_seek_frame(self->fmt,self->istream,0,AVSEEK_FLAG_BACKWARD);
+  reset_queues(self);
+}
+
+/** \returns the frame count, counting the packets first if open_reader() couldn't
+    take it from the container.  Deferring the count lets read_chunks() hand its
+    readers the count it already has.
+ */
+static int64_t frames(ndio_ffmpeg_t self)
+{ if(self->nframes<0)
+    count_frames(self);
+  return self->nframes;
+}
+
+/** Follow mode: counts the frames that have arrived since the last refresh. */
+static void refresh(ndio_ffmpeg_t self)
+{ AVPacket p={0};
+  int64_t n;
+  if(!self->scout)
+    return;
+  n=self->nframes;
+  av_init_packet(&p);
+  while(av_read_frame(self->scout,&p)>=0)
+  { if(p.stream_index==self->istream)
+      ++self->nframes;
+    av_free_packet(&p);
+  }
+  self->scout->pb->eof_reached=0; // so the next refresh picks up where this one ran out
+  if(self->nframes>n && self->fmt && self->fmt->pb)
+    self->fmt->pb->eof_reached=0; // the main demuxer may have run out earlier; there's more now
+}
+
+/** Follow mode: waits up to the timeout for the file to hold more than \a n frames.
+    \returns 1 if it does, otherwise 0.
+ */
+static int wait_for(ndio_ffmpeg_t self, int64_t n)
+{ int64_t deadline=av_gettime()+self->follow_usec;
+  refresh(self);
+  while(self->nframes<=n && av_gettime()<deadline)
+  { av_usleep(FOLLOW_POLL_USEC);
+    refresh(self);
+  }
+  return self->nframes>n;
+}
+
+/** Sets up follow mode for a file that is still being written.
+    The scout is opened without probing the streams, and replaces the
+    container's duration as the source of the frame count.
+
+    Only nut is supported.  Resuming after end of file relies on the demuxer
+    reading on once the I/O context's eof flag is cleared.  The matroska and
+    mov demuxers keep their own end-of-file state and stop for good instead.
+ */
+static int open_scout(ndio_ffmpeg_t self, const char *path, double timeout)
+{ if(!in("nut",self->fmt->iformat->name))
+    FAIL("Follow mode needs a nut file.  Other demuxers stop at the first end of file they see.");
+  self->follow_usec=(int64_t)(timeout*1e6);
+  AVTRY(avformat_open_input(&self->scout,path,NULL,NULL),path);
+  self->nframes=0;
+  refresh(self);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Reopens decoders whose thread count no longer matches their share of the
+    process-wide budget, because other files were opened or closed.  Only done
+    at a seek, where the decoders are flushed anyway.  A decoder that won't
+    reopen with its new share is reopened with the thread count it had.
+    \returns 0 if that fails too, leaving the decoder closed.
+ */
+static int rebalance(ndio_ffmpeg_t self)
+{ int i,n=2+(self->nch>1?self->nch-1:0),share=budget_share();
+  AVDictionary *opts=0;
+  if(self->dec_threads>0 || av_dict_get(self->decopts,"threads",NULL,0))
+    return 1;
+  for(i=0;i<n;++i)
+  { AVCodecContext *cctx;
+    AVCodec *codec;
+    int s=(i==0)?self->istream:(i==1)?self->lo:self->ch[i-1],
+        old;
+    if(s<0) continue;
+    cctx=self->fmt->streams[s]->codec;
+    if(!(codec=(AVCodec*)cctx->codec) || cctx->thread_count==share)
+      continue;
+    old=cctx->thread_count;
+    avcodec_close(cctx);
+    cctx->thread_count=share;
+    av_dict_copy(&opts,self->decopts,0);
+    if(avcodec_open2(cctx,codec,&opts)<0)
+    { av_dict_free(&opts);
+      cctx->thread_count=old;
+      av_dict_copy(&opts,self->decopts,0);
+      AVTRY(avcodec_open2(cctx,codec,&opts),"Failed to reopen decoder.");
+    }
+    av_dict_free(&opts);
+  }
+  return 1;
+Error:
+  if(opts) av_dict_free(&opts);
+  return 0;
+}
+
+/** Gives back this file's shares of the process-wide thread budget. */
+static void release_shares(ndio_ffmpeg_t self)
+{ for(;self->nshares>0;--self->nshares)
+    budget_leave();
+}
+
+/** Opens the decoder for stream \a istream. */
+static int open_decoder(ndio_ffmpeg_t self, int istream, AVCodec *codec)
+{ AVCodecContext *cctx=self->fmt->streams[istream]->codec;
+  AVDictionary *opts=0;
+  if(!codec)
+    TRY(codec=avcodec_find_decoder(cctx->codec_id));
+  if(self->dec_type)
+    cctx->thread_type=self->dec_type;
+  else if(cctx->codec_id==CODEC_ID_FFV1) // lossless archives are written multi-slice, so decode the slices in parallel
+    cctx->thread_type=FF_THREAD_SLICE;
+  if(self->dec_threads>0)
+    cctx->thread_count=self->dec_threads;
+  else
+  { cctx->thread_count=budget_join();
+    ++self->nshares;
+  }
+  av_dict_copy(&opts,self->decopts,0);
+  AVTRY(avcodec_open2(cctx,codec,&opts),"Cannot open video decoder."); // inits the selected stream's codec context
+  TRY(check_options(self->decopts,opts,"decoder"));
+  av_dict_free(&opts);
+  self->q[istream].wanted=1;
+  return 1;
+Error:
+  if(opts) av_dict_free(&opts);
+  return 0;
+}
+
+/** Generalized Anscombe transform.  \a vst is the detector's gain, offset
+    (dark level) and read noise.  Poisson-Gaussian counts come out with
+    roughly unit noise variance at every intensity.
+ */
+static double anscombe(double x, const double *vst)
+{ const double a=vst[0],v=a*x+0.375*a*a+vst[2]*vst[2]-a*vst[1];
+  return (v>0.0)?2.0/a*sqrt(v):0.0;
+}
+
+/** Parses "gain,offset,sigma" into \a vst (see anscombe()). */
+static int parse_anscombe(const char *s, double *vst)
+{ return 3==sscanf(s,"%lf,%lf,%lf",vst,vst+1,vst+2) && vst[0]>0.0;
+}
+
+/** Fills the 65536-entry \a lut that maps [\a lo,\a hi] to 0..255 along
+    t^(1/gamma).  With \a vst, t is measured after the Anscombe transform, so
+    the levels are spaced evenly in noise rather than intensity.
+ */
+static int window_lut(uint8_t *lut, int lo, int hi, double gamma, const double *vst)
+{ const double f0=vst?anscombe(lo,vst):lo,
+               f1=vst?anscombe(hi,vst):hi;
+  int x;
+  if(!(f1>f0))
+    return 0;
+  for(x=0;x<65536;++x)
+  { double t=((vst?anscombe(x,vst):x)-f0)/(f1-f0);
+    t=t<0.0?0.0:(t>1.0?1.0:t);
+    lut[x]=(uint8_t)(255.0*pow(t,1.0/gamma)+0.5);
+  }
+  return 1;
+}
+
+/** Finds where \a lut stops saturating: *lo is the last input of the run of
+    inputs at the bottom that share lut[0]'s level, *hi the first of the run at
+    the top that shares lut[65535]'s.  A constant table gives the whole range.
+ */
+static void lut_range(const uint8_t *lut, int *lo, int *hi)
+{ int x;
+  for(x=0;x<65535 && lut[x+1]==lut[0];++x) {}
+  *lo=x;
+  for(x=65535;x>0 && lut[x-1]==lut[65535];--x) {}
+  *hi=x;
+  if(*hi<=*lo)
+  { *lo=0;
+    *hi=65535;
+  }
+}
+
+/** Fills the 256-entry \a inv with the mean input in [\a lo,\a hi] for each output level of \a lut.
+    The levels of \a lo and \a hi map back to exactly \a lo and \a hi: inputs
+    outside the range saturate onto those levels, and averaging them in would
+    pull the end levels far out of the range.  Unused levels repeat the previous one.
+ */
+static void invert_lut(const uint8_t *lut, int lo, int hi, uint16_t *inv)
+{ double sum[256]={0},cnt[256]={0};
+  int x,v,last=lo;
+  for(x=lo;x<=hi;++x)
+  { sum[lut[x]]+=x;
+    cnt[lut[x]]++;
+  }
+  sum[lut[lo]]=lo; cnt[lut[lo]]=1;
+  sum[lut[hi]]=hi; cnt[lut[hi]]=1;
+  for(v=0;v<256;++v)
+  { if(cnt[v]) last=(int)(sum[v]/cnt[v]+0.5);
+    inv[v]=(uint16_t)last;
+  }
+}
+
+/** Builds the u8 to u16 table that undoes the writer's intensity window, if there was one.
+    The inverse is approximate: each 8-bit level maps back to one representative u16 value.
+ */
+static int maybe_read_window(ndio_ffmpeg_t self)
+{ const char *v;
+  int i;
+  if((v=meta_get(self,"window")))
+  { int lo,hi;
+    double gamma;
+    const char *a=meta_get(self,"anscombe");
+    TRY(3==sscanf(v,"%d,%d,%lf",&lo,&hi,&gamma));
+    TRY(self->inv=(uint16_t*)malloc(256*sizeof(uint16_t)));
+    if(a) // the levels are spaced in the stabilized domain; recover the mean count for each
+    { double vst[3];
+      uint8_t *lut;
+      int ok;
+      TRY(parse_anscombe(a,vst));
+      TRY(lut=(uint8_t*)malloc(65536));
+      ok=window_lut(lut,lo,hi,gamma,vst);
+      if(ok) invert_lut(lut,lo,hi,self->inv); // the window's ends map back to lo and hi, as on the linear path
+      free(lut);
+      TRY(ok);
+    } else
+      for(i=0;i<256;++i)
+        self->inv[i]=(uint16_t)(lo+(hi-lo)*pow(i/255.0,gamma)+0.5);
+  } else if((v=meta_get(self,"lut_inverse")))
+  { char *copy,*bookmark,*token;
+    TRY(self->inv=(uint16_t*)calloc(256,sizeof(uint16_t)));
+    TRY(copy=bookmark=strdup(v));
+    for(i=0;i<256 && (token=strsep(&bookmark,","))!=NULL;++i)
+      self->inv[i]=(uint16_t)atoi(token);
+    free(copy);
+  }
+  return 1;
+Error:
+  return 0;
+}
+
+/** Sets up reading several video streams as channels: the streams of a file
+    written with ndio_ffmpeg_params_t::channel_streams, or those the caller
+    picked with ndio_ffmpeg_params_t::streams.  Opens the decoders for all but
+    the first, which is opened as the main stream.
+    \param[in] list  The streams, in channel order, as "i,j,k,...".
+ */
+static int open_channels(ndio_ffmpeg_t self, const char *list)
+{ char *copy=0,*bookmark,*token;
+  int k,n=1;
+  for(token=(char*)list;*token;++token)
+    n+=(*token==',');
+  TRY(self->ch    =(int*)calloc(n,sizeof(int)));
+  TRY(self->ch_raw=(AVFrame**)calloc(n,sizeof(AVFrame*)));
+  TRY(self->ch_sws=(struct SwsContext**)calloc(n,sizeof(struct SwsContext*)));
+  TRY(copy=bookmark=strdup(list));
+  while(self->nch<n && (token=strsep(&bookmark,","))!=NULL)
+  { k=atoi(token);
+    TRY(0<=k && k<(int)self->fmt->nb_streams);
+    TRY(self->fmt->streams[k]->codec->codec_type==AVMEDIA_TYPE_VIDEO);
+    self->ch[self->nch++]=k;
+  }
+  SAFEFREE(copy);
+  self->istream=self->ch[0];
+  for(k=1;k<self->nch;++k)
+  { TRY(open_decoder(self,self->ch[k],NULL));
+    TRY(self->ch_raw[k]=avcodec_alloc_frame());
+  }
+  TRY(self->mux=mutex_alloc()); // serializes demuxing (see decode_to())
+  return 1;
+Error:
+  SAFEFREE(copy);
+  return 0;
+}
+
+/** Gets the rectangle of tile \a k of a tiled file.  Tiles on the right and bottom edges may be smaller. */
+static void tile_rect(ndio_ffmpeg_t self, int k, int *x, int *y, int *w, int *h)
+{ *x=(k%self->tcols)*self->tw;
+  *y=(k/self->tcols)*self->th;
+  *w=(self->pw-*x<self->tw)?(self->pw-*x):self->tw;
+  *h=(self->ph-*y<self->th)?(self->ph-*y):self->th;
+}
+
+/** Sets up reading the tiles of a tiled file that intersect the region \a roi.
+    \param[in] tiles  The "tiles" metadata: W,H,tw,th.
+    \param[in] roi    The region to read, as "x,y,w,h", or NULL for whole planes.
+ */
+static int open_tiles(ndio_ffmpeg_t self, const char *tiles, const char *roi)
+{ int r[4],i,j,ok,rows;
+  char *list=0,*t;
+  TRY(4==sscanf(tiles,"%d,%d,%d,%d",&self->pw,&self->ph,&self->tw,&self->th));
+  TRY(self->pw>0 && self->ph>0 && self->tw>0 && self->th>0);
+  self->tcols=(self->pw+self->tw-1)/self->tw;
+  rows       =(self->ph+self->th-1)/self->th;
+  TRY(self->tcols*rows<=(int)self->fmt->nb_streams);
+  r[0]=r[1]=0; r[2]=self->pw; r[3]=self->ph;
+  if(roi)
+    TRY(4==sscanf(roi,"%d,%d,%d,%d",r,r+1,r+2,r+3));
+  if(!(0<=r[0] && 0<=r[1] && 0<r[2] && 0<r[3] && r[0]+r[2]<=self->pw && r[1]+r[3]<=self->ph))
+    FAIL("The roi must lie within the plane.");
+  self->rx=r[0]; self->w=r[2];
+  self->ry=r[1]; self->h=r[3];
+  NEW(char,list,12*self->tcols*rows+1);
+  for(t=list,j=r[1]/self->th;j<=(r[1]+r[3]-1)/self->th;++j)
+    for(i=r[0]/self->tw;i<=(r[0]+r[2]-1)/self->tw;++i)
+      t+=sprintf(t,(t==list)?"%d":",%d",i+self->tcols*j);
+  ok=open_channels(self,list);
+  free(list);
+  TRY(ok);
+  TRY(self->ch_stage=(AVFrame**)calloc(self->nch,sizeof(AVFrame*)));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Lists the video streams that match the best one in size and pixel format.
+    \returns the stream indices as "i,j,...", which the caller frees, or NULL on failure.
+ */
+static char* video_streams(ndio_ffmpeg_t self)
+{ AVCodecContext *best;
+  char *list=0,*t;
+  unsigned i;
+  int b;
+  AVTRY(b=av_find_best_stream(self->fmt,AVMEDIA_TYPE_VIDEO,-1,-1,NULL,0),"Failed to find a video stream.");
+  best=self->fmt->streams[b]->codec;
+  NEW(char,list,12*self->fmt->nb_streams+1);
+  for(i=0,t=list;i<self->fmt->nb_streams;++i)
+  { AVCodecContext *c=self->fmt->streams[i]->codec;
+    if(c->codec_type==AVMEDIA_TYPE_VIDEO
+       && c->width==best->width && c->height==best->height && c->pix_fmt==best->pix_fmt)
+      t+=sprintf(t,(t==list)?"%u":",%u",i);
+  }
+  return list;
+Error:
+  SAFEFREE(list);
+  return 0;
+}
+
+/** Restricts reading to the region \a roi ("x,y,w,h") of planes \a w by \a h pixels. */
+static int set_region(ndio_ffmpeg_t self, const char *roi)
+{ int r[4];
+  TRY(4==sscanf(roi,"%d,%d,%d,%d",r,r+1,r+2,r+3));
+  if(!(0<=r[0] && 0<=r[1] && 0<r[2] && 0<r[3] && r[0]+r[2]<=self->w && r[1]+r[3]<=self->h))
+    FAIL("The roi must lie within the plane.");
+  self->cw=(r[2]<MIN_SWS_WIDTH)?MIN_SWS_WIDTH:r[2];
+  if(self->cw>self->w)
+    self->cw=self->w;
+  self->cx=(r[0]+self->cw<=self->w)?r[0]:(self->w-self->cw);
+  self->rx=r[0]; self->w=r[2];
+  self->ry=r[1]; self->h=r[3];
+  self->roi=1;
+  return 1;
+Error:
+  return 0;
+}
+
+/** Parses norm_planes metadata, "scale:offset,scale:offset,...", one pair per plane. */
+static int parse_norm_planes(ndio_ffmpeg_t self, const char *v)
+{ const char *c;
+  int64_t n=1,i;
+  for(c=v;*c;++c)
+    if(*c==',') ++n;
+  NEW(float,self->norm,2*n);
+  for(i=0;i<n;++i)
+  { char *end;
+    self->norm[2*i]=(float)strtod(v,&end);
+    TRY(*end==':');
+    self->norm[2*i+1]=(float)strtod(end+1,&end);
+    TRY(*end==',' || *end=='\0');
+    v=end+1;
+  }
+  self->nnorm=n;
+  return 1;
+Error:
+  SAFEFREE(self->norm);
+  return 0;
+}
+
 /** Opens the file at \a path for reading */
-static ndio_ffmpeg_t open_reader(const char* path)
+static ndio_ffmpeg_t open_reader(const char* path, const ndio_ffmpeg_params_t *params)
 { ndio_ffmpeg_t self=0;
+  AVDictionary *user=0,*opts=0;
   NEW(struct _ndio_ffmpeg_t,self,1);
   memset(self,0,sizeof(*self));
   self->iframe=-1;
+  self->lo=-1;
+  TRY(self->path=strdup(path)); // for opening more readers, see read_chunks()
 
   TRY(self->raw=avcodec_alloc_frame());
-  AVTRY(avformat_open_input(&self->fmt,path,NULL/*input format*/,NULL/*options*/),path);
+  if(params)
+  { TRY(parse_options(&user,params->demux_options));
+    TRY(parse_options(&self->decopts,params->decoder_options));
+    self->dec_threads=params->decoder_threads;
+    if(params->decoder_threading)
+    { if     (streq(params->decoder_threading,"frame")) self->dec_type=FF_THREAD_FRAME;
+      else if(streq(params->decoder_threading,"slice")) self->dec_type=FF_THREAD_SLICE;
+      else if(streq(params->decoder_threading,"auto"))  self->dec_type=FF_THREAD_FRAME|FF_THREAD_SLICE;
+      else FAIL("Unknown decoder_threading.  Expected frame, slice or auto.");
+    }
+  }
+  av_dict_copy(&opts,user,0);
+  AVTRY(avformat_open_input(&self->fmt,path,NULL/*input format*/,&opts),path);
+  TRY(check_options(user,opts,"demuxer"));
+  av_dict_free(&opts);
+  av_dict_free(&user);
   AVTRY(avformat_find_stream_info(self->fmt,NULL),"Failed to find stream information.");
+  TRY(self->q=(pktq_t*)calloc(self->fmt->nb_streams,sizeof(pktq_t)));
+  TRY(meta_read(self,self->fmt));
+  { const char *v=meta_get(self,"parts");
+    if(v)
+    { char *part;
+      TRY(2==sscanf(v,"%d,%d",&self->pc,&self->pt) && self->pc>0 && self->pt>0);
+      for(;;++self->pt) // time points written after the tag was
+      { int found;
+        TRY(part=part_path(path,0,self->pt));
+        found=avio_check(part,AVIO_FLAG_READ)>=0;
+        free(part);
+        if(!found)
+          break;
+      }
+      TRY(self->parts=(ndio_t*)calloc(self->pc*self->pt,sizeof(ndio_t)));
+    }
+  }
   { AVCodec        *codec=0;
-    AVCodecContext *cctx=CCTX(self);
-    AVTRY(self->istream=av_find_best_stream(self->fmt,AVMEDIA_TYPE_VIDEO,-1,-1,&codec,0/*flags*/),"Failed to find a video stream.");
-    AVTRY(avcodec_open2(cctx,codec,NULL/*options*/),"Cannot open video decoder."); // inits the selected stream's codec context
-
-    TRY(self->sws=sws_getContext(cctx->width,cctx->height,cctx->pix_fmt,
-                                  cctx->width,cctx->height,pixfmt_to_output_pixfmt(cctx->pix_fmt),
-                                  SWS_BICUBIC,NULL,NULL,NULL));
+    AVCodecContext *cctx=0;
+    const char     *split;
+    if(params && params->streams) // the caller's choice of streams
+    { char *all=0;
+      int ok;
+      if(streq(params->streams,"all"))
+        TRY(all=video_streams(self));
+      ok=open_channels(self,all?all:params->streams);
+      SAFEFREE(all);
+      TRY(ok);
+    } else if((split=meta_get(self,"split16"))) // high and low bytes are in separate streams
+    { int hi,lo,n=(int)self->fmt->nb_streams;
+      TRY(2==sscanf(split,"%d,%d",&hi,&lo));
+      TRY(0<=hi && hi<n && 0<=lo && lo<n);
+      self->istream=hi;
+      self->lo=lo;
+      TRY(open_decoder(self,lo,NULL));
+      TRY(self->lo_raw=avcodec_alloc_frame());
+    } else if((split=meta_get(self,"channels"))) // one stream per channel
+      TRY(open_channels(self,split));
+    else if((split=meta_get(self,"tiles")))    // one stream per tile
+      TRY(open_tiles(self,split,params?params->roi:NULL));
+    else
+      AVTRY(self->istream=av_find_best_stream(self->fmt,AVMEDIA_TYPE_VIDEO,-1,-1,&codec,0/*flags*/),"Failed to find a video stream.");
+    TRY(open_decoder(self,self->istream,codec));
+    cctx=CCTX(self);
+    TRY(maybe_read_window(self));
+    if(self->inv && !is_luma8(cctx->pix_fmt))
+      FAIL("Expected 8-bit luma for a stream written through an intensity window.");
+
+    if(!self->tcols) // tiled files were sized by open_tiles()
+    { const char *size=meta_get(self,"size"); // written size, before padding to even
+      if(!( size && 2==sscanf(size,"%d,%d",&self->w,&self->h)
+          && 0<self->w && self->w<=cctx->width
+          && 0<self->h && self->h<=cctx->height))
+      { self->w=cctx->width;
+        self->h=cctx->height;
+      }
+      if(params && params->roi)
+        TRY(set_region(self,params->roi));
+      else
+        self->cw=self->w;
+    } else
+      self->roi=(params && params->roi);
+    { const char *norm=meta_get(self,"norm");
+      if(params && params->scale!=0.0)
+      { self->scale =(float)params->scale;
+        self->offset=(float)params->offset;
+      } else if(!(norm && 2==sscanf(norm,"%f,%f",&self->scale,&self->offset)))
+      { self->scale =1.0f/65535.0f;
+        self->offset=0.0f;
+      }
+      if(!(params && params->scale!=0.0) && (norm=meta_get(self,"norm_planes")))
+        TRY(parse_norm_planes(self,norm));
+    }
+    if(self->lo<0 && !self->inv && !self->tcols)
+      TRY(self->sws=sws_getContext(self->cw,self->h,cctx->pix_fmt,
+                                    self->cw,self->h,pixfmt_to_output_pixfmt(cctx->pix_fmt),
+                                    SWS_BICUBIC,NULL,NULL,NULL));
+    if(self->nch)
+    { int k;
+      self->ch_raw[0]=self->raw;
+      self->ch_sws[0]=self->sws;
+      if(!self->ch_stage && self->cw!=self->w) // narrow regions are converted wider, then cropped
+        TRY(self->ch_stage=(AVFrame**)calloc(self->nch,sizeof(AVFrame*)));
+      for(k=0;k<self->nch;++k)
+      { AVCodecContext *c=self->fmt->streams[self->ch[k]]->codec;
+        int x,y,w=self->cw,h=self->h;
+        if(self->tcols) // each tile is converted whole, then cropped to the region
+          tile_rect(self,self->ch[k],&x,&y,&w,&h);
+        else if(c->width!=cctx->width || c->height!=cctx->height || c->pix_fmt!=cctx->pix_fmt)
+          FAIL("The streams to read differ in size or pixel format.");
+        if(self->ch_stage)
+        { TRY(self->ch_stage[k]=avcodec_alloc_frame());
+          AVTRY(av_image_alloc(self->ch_stage[k]->data,self->ch_stage[k]->linesize,w,h,
+                               pixfmt_to_output_pixfmt(c->pix_fmt),FRAME_ALIGN),"Failed to allocate frame.");
+        }
+        if(k==0 && self->sws)
+          continue;
+        TRY(self->ch_sws[k]=sws_getContext(w,h,c->pix_fmt,
+                                           w,h,pixfmt_to_output_pixfmt(c->pix_fmt),
+                                           SWS_BICUBIC,NULL,NULL,NULL));
+      }
+    }
 
     self->nframes  = DURATION(self);
+    if(params && params->follow>0.0)
+      TRY(open_scout(self,path,params->follow));
+    else if(!container_frames(self))
+      self->nframes=-1; // counted when first needed; see frames()
   }
   return self;
 Error:
   if(self)
-  { if(self->fmt)
-    { if(CCTX(self)) avcodec_close(CCTX(self));
-      avformat_free_context(self->fmt);
-    }
+  { release_reader(self);
+    release_shares(self);
     if(self->opts) av_dict_free(&self->opts);
+    if(self->decopts) av_dict_free(&self->decopts);
+    if(self->meta) av_dict_free(&self->meta);
     if(self->raw)  av_free(self->raw);
     if(self->sws)  sws_freeContext(self->sws);
-
+    if(self->mux)  mutex_free(self->mux);
+    SAFEFREE(self->parts);
+    SAFEFREE(self->path);
     free(self);
   }
+  if(user) av_dict_free(&user);
+  if(opts) av_dict_free(&opts);
   return NULL;
 }
 
@@ -353,7 +1395,9 @@ static ndio_ffmpeg_t open_writer(const char* path)
   AVCodec *codec;
   NEW(struct _ndio_ffmpeg_t,self,1);
   memset(self,0,sizeof(*self));
-  TRY(self->raw=avcodec_alloc_frame());
+  self->lo=-1;
+  TRY(self->mux=mutex_alloc());
+  TRY(self->path=strdup(path)); // for naming the parts of 5D arrays
 
   AVTRY(avformat_alloc_output_context2(&self->fmt,NULL,NULL,path), "Failed to detect output file format from the file name.");
   TRY(self->fmt->oformat && self->fmt->oformat->video_codec!=CODEC_ID_NONE); //Assert that this is a video output format
@@ -366,108 +1410,842 @@ static ndio_ffmpeg_t open_writer(const char* path)
   AVTRY(CCTX(self)->pix_fmt=codec->pix_fmts[0],"Codec indicates that no pixel formats are supported.");
   return self;
 Error:
-  if(self->fmt->pb) avio_close(self->fmt->pb);
-  if(self->opts) av_dict_free(&self->opts);
   if(self)
-  { if(self->fmt)  avformat_free_context(self->fmt);
+  { if(self->fmt)
+    { if(self->fmt->pb) avio_close(self->fmt->pb);
+      avformat_free_context(self->fmt);
+    }
+    if(self->mux) mutex_free(self->mux);
+    SAFEFREE(self->path);
     free(self);
   }
   return NULL;
 }
 
-/** Encodes the input frame, outputing any resulting packets to the output stream.
- *
- *  \param[in]      file    Output file context.  Passed in for logging purposes.
- *  \param[in]      fmt     The output format context.
- *  \param[in]      cctx    The encoding context.
- *  \param[in]      stream  The stream context.
- *  \param[in]      packet  Address of init'd (maybe pre-allocated) packet.
- *  \param[in]      frame   The video frame to encode.
- *  \param[out] got_packet  1 if encoding yielded a packet, 0 otherwise.
+/** Sets up periodic flushing for streaming output.
+    mp4 and mov are switched to fragmented mp4: an empty moov up front, then
+    one moof per flush, so every flushed frame is indexed in the file.
+    Other containers (mkv, nut) are readable as they grow, and are just pushed to disk.
  */
-static int push(ndio_t file, AVPacket *p, AVFrame *frame, int *got_packet)
-{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
-  AVFormatContext *fmt=self->fmt;
-  AVCodecContext *cctx=CCTX(self);
-  AVStream     *stream=STREAM(self);
-  *got_packet=0;
-  AVTRY(avcodec_encode_video2(cctx,p,frame,got_packet), frame?"Failed to encode frame.":"Failed to encode terminating frame.");
-  if(*got_packet)
-  { if (p->pts != AV_NOPTS_VALUE)
-      p->pts = av_rescale_q(p->pts, cctx->time_base, stream->time_base);
-    if (p->dts != AV_NOPTS_VALUE)
-      p->dts = av_rescale_q(p->dts, cctx->time_base, stream->time_base);
-    AVTRY(av_write_frame(fmt,p),"Failed to write packet.");
-    self->nframes++; // at the moment, mostly just use this to record that we did write something.
-    av_destruct_packet(p);
-  }
+static int init_fragments(ndio_ffmpeg_t self, const ndio_ffmpeg_params_t *params)
+{ const AVClass **cls=&self->fmt->oformat->priv_class;
+  if(params->fragment<=0 && params->fragment_seconds<=0.0)
+    return 1;
+  self->frag_frames=params->fragment>0?params->fragment:0;
+  self->frag_usec  =params->fragment_seconds>0.0?(int64_t)(params->fragment_seconds*1e6):0;
+  self->frag_t     =av_gettime();
+  if(*cls && av_opt_find(cls,"movflags",NULL,0,AV_OPT_SEARCH_FAKE_OBJ))
+    TRY(av_dict_set(&self->opts,"movflags","frag_custom+empty_moov",0)>=0);
+  TRY(meta_set(self,"fragment","1")); // the file may be left unfinished, so readers check its frame count (see container_frames())
   return 1;
 Error:
   return 0;
 }
 
-/** Flushes frames, writes the footer and closes the output file. */
-static int close_writer(ndio_t file)
-{ ndio_ffmpeg_t self;
-  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
-  TRY(CCTX(self)->codec); // codec might not have been opened
-  if(self->nframes)
-  { if(CCTX(self)->codec->capabilities & CODEC_CAP_DELAY)
-    { AVPacket p={0};
-      int got_packet=1;
-      av_init_packet(&p);
-      while(got_packet)
-        TRY(push(file,&p,NULL,&got_packet));
-    }
-    AVTRY(av_write_trailer(self->fmt),"Failed to write trailer.");
-  }
+/** Writes the container header, with the caller's muxer options. */
+static int write_header(ndio_ffmpeg_t self, const ndio_ffmpeg_params_t *params)
+{ AVDictionary *user=0;
+  TRY(parse_options(&user,params->format_options));
+  av_dict_copy(&self->opts,user,0);
+  TRY(meta_write(self));
+  AVTRY(avformat_write_header(self->fmt,&self->opts),"Failed to write header.");
+  TRY(check_options(user,self->opts,"format"));
+  av_dict_free(&user);
   return 1;
 Error:
-  if(self->fmt->pb) avio_close(self->fmt->pb);
+  if(user) av_dict_free(&user);
   return 0;
 }
 
-/** Intializes the codec context if necessary. */
-static int maybe_init_codec_ctx(ndio_ffmpeg_t self, int width, int height, int fps, int src_pixfmt, const ndio_ffmpeg_params_t *params)
-{ AVCodecContext *cctx=CCTX(self);
-  const AVCodec *codec=cctx->codec;
-  if(!cctx->width)
-  { cctx->width =even(width);
-    cctx->height=even(height);
-    cctx->time_base.num=1;
-    cctx->time_base.den=fps;
-    cctx->gop_size=12;
+/** Append mode: whether the file can be extended in place.
+    nut files, and mp4 files written as fragments (see init_fragments()), are
+    a header followed by pieces that each stand alone, so more pieces can
+    simply follow.  Only files written with the fragment key are trusted to
+    have been laid out that way.
+ */
+static int can_extend(ndio_ffmpeg_t self)
+{ const AVClass **cls=&self->fmt->oformat->priv_class;
+  if(!meta_get(self,"fragment"))
+    return 0;
+  if(!strcmp(self->fmt->oformat->name,"nut"))
+    return 1;
+  return *cls && av_opt_find(cls,"movflags",NULL,0,AV_OPT_SEARCH_FAKE_OBJ);
+}
 
-    {
-      #define SET(k,v) \
-        if(v) AVTRY(av_dict_set(&self->opts,(k),(v),0),"Failed to set options.")
-      SET("crf"   ,params->crf);
-      SET("preset",params->preset);
-      SET("tune"  ,params->tune);
-      #undef SET
-    }
+/** Append mode, extending in place: sets up the muxer as for a new file, but
+    throws away the header it writes, since the file already starts with one.
+    mp4 output is always fragmented, so nothing needs to go back to the start.
+ */
+static int skip_header(ndio_ffmpeg_t self, const ndio_ffmpeg_params_t *params)
+{ uint8_t *buf=0;
+  int ok;
+  AVTRY(avio_open_dyn_buf(&self->fmt->pb),"Failed to allocate header buffer.");
+  ok=init_fragments(self,params);
+  if(ok && strcmp(self->fmt->oformat->name,"nut"))
+    ok=av_dict_set(&self->opts,"movflags","frag_custom+empty_moov",0)>=0;
+  ok=ok && write_header(self,params);
+  avio_close_dyn_buf(self->fmt->pb,&buf);
+  av_free(buf);
+  self->fmt->pb=0;
+  return ok;
+Error:
+  return 0;
+}
 
-    AVTRY(avcodec_open2(cctx,codec,&self->opts),"Failed to initialize encoder.");
+/** Opens the existing file at \a path for appending.
 
-    TRY(self->sws=sws_getContext(
-      width,height,src_pixfmt,
-      even(width),even(height),cctx->pix_fmt,
-      SWS_BICUBIC,NULL,NULL,NULL));
+    Files that can_extend() are opened where they are, and new planes are
+    muxed after the last piece.  libavformat can't resume other finished
+    files in place, so their packets are stream-copied (not decoded) into a
+    new file next to it, which replaces the old one when it's closed.  Either
+    way, new planes are encoded with timestamps that continue the file's.
+    If there is no file at \a path, this is the same as open_writer().
 
-    TRY(av_image_alloc(self->raw->data,self->raw->linesize,even(width),even(height),cctx->pix_fmt,1));
-    AVTRY(avformat_write_header(self->fmt,&self->opts),"Failed to write header.");
+    The copy costs a read and a write of the whole file, and as much free
+    space again, so only files written by this plugin are accepted (see
+    \ref ndio-ffmpeg-append).
+ */
+static ndio_ffmpeg_t open_appender(const char* path, const ndio_ffmpeg_params_t *params)
+{ ndio_ffmpeg_t self=0;
+  AVFormatContext *in=0;
+  AVPacket p={0};
+  unsigned i;
+  if(avio_check(path,AVIO_FLAG_READ)<0)
+    return open_writer(path);
+  NEW(struct _ndio_ffmpeg_t,self,1);
+  memset(self,0,sizeof(*self));
+  self->lo=-1;
+  TRY(self->mux=mutex_alloc());
+  TRY(self->path=strdup(path));
+  TRY(self->tmp=(char*)malloc(strlen(path)+sizeof(".append")));
+  sprintf(self->tmp,"%s.append",path);
+
+  AVTRY(avformat_open_input(&in,path,NULL,NULL),path);
+  AVTRY(avformat_find_stream_info(in,NULL),"Failed to find stream information.");
+  { AVDictionaryEntry *e=av_dict_get(in->metadata,META_TAG,NULL,0);
+    if(!e || strncmp(e->value,META_ID,strlen(META_ID)))
+      FAIL("Append mode only extends files written by this plugin.");
+  }
+  TRY(meta_read(self,in));
+  AVTRY(self->istream=av_find_best_stream(in,AVMEDIA_TYPE_VIDEO,-1,-1,NULL,0),"Failed to find a video stream.");
+  { const char *split=meta_get(self,"split16");
+    if(split) TRY(1==sscanf(split,"%d",&self->istream));
   }
-  return 1;
-Error:
-  return 0;
-}
 
-/** Opens the file at \a path according to the specified \a mode. */
+  AVTRY(avformat_alloc_output_context2(&self->fmt,NULL,NULL,path), "Failed to detect output file format from the file name.");
+  TRY(0==(self->fmt->flags&AVFMT_NOFILE));
+  av_dict_copy(&self->fmt->metadata,in->metadata,0);
+  TRY(self->base=(int64_t*)calloc(in->nb_streams,sizeof(int64_t)));
+  for(i=0;i<in->nb_streams;++i)
+  { AVStream *st;
+    TRY(st=avformat_new_stream(self->fmt,NULL));
+    AVTRY(avcodec_copy_context(st->codec,in->streams[i]->codec),"Failed to copy stream parameters.");
+    st->codec->codec_tag=0;                      // let the muxer choose
+    st->codec->time_base=in->streams[i]->time_base; // so copied timestamps carry over exactly
+    st->sample_aspect_ratio=in->streams[i]->sample_aspect_ratio;
+  }
+  av_init_packet(&p);
+  if(can_extend(self))
+  { TRY(skip_header(self,params));
+    SAFEFREE(self->tmp); // nothing to replace on close
+    while(av_read_frame(in,&p)>=0)
+    { self->base[p.stream_index]++;
+      av_free_packet(&p);
+    }
+    avformat_close_input(&in);
+    AVTRY(avio_open(&self->fmt->pb,path,AVIO_FLAG_READ_WRITE),"Failed to open file for appending."); // doesn't truncate
+    TRY(avio_seek(self->fmt->pb,0,SEEK_END)>=0);
+    self->nframes=self->base[self->istream];
+    return self;
+  }
+  AVTRY(avio_open(&self->fmt->pb,self->tmp,AVIO_FLAG_WRITE),"Failed to open output file.");
+  TRY(init_fragments(self,params));
+  TRY(write_header(self,params));
+
+  while(av_read_frame(in,&p)>=0)
+  { AVStream *ist=in->streams[p.stream_index],
+             *ost=self->fmt->streams[p.stream_index];
+    int err;
+    if(p.pts!=AV_NOPTS_VALUE) p.pts=av_rescale_q(p.pts,ist->time_base,ost->time_base);
+    if(p.dts!=AV_NOPTS_VALUE) p.dts=av_rescale_q(p.dts,ist->time_base,ost->time_base);
+    p.duration=(int)av_rescale_q(p.duration,ist->time_base,ost->time_base);
+    p.pos=-1;
+    self->base[p.stream_index]++;
+    err=av_interleaved_write_frame(self->fmt,&p);
+    av_free_packet(&p);
+    AVTRY(err,"Failed to copy packet.");
+  }
+  self->nframes=self->base[self->istream];
+  avformat_close_input(&in);
+  return self;
+Error:
+  av_free_packet(&p);
+  if(in) avformat_close_input(&in);
+  if(self)
+  { if(self->fmt)
+    { if(self->fmt->pb)
+      { avio_close(self->fmt->pb);
+        if(self->tmp) remove(self->tmp);
+      }
+      avformat_free_context(self->fmt);
+    }
+    if(self->mux)  mutex_free(self->mux);
+    if(self->meta) av_dict_free(&self->meta);
+    if(self->opts) av_dict_free(&self->opts);
+    SAFEFREE(self->base);
+    SAFEFREE(self->path);
+    SAFEFREE(self->tmp);
+    free(self);
+  }
+  return NULL;
+}
+
+/** Append mode: replaces the original file with the extended one. */
+static int finish_append(ndio_ffmpeg_t self)
+{ if(!self->tmp)
+    return 1;
+#ifdef _MSC_VER
+  TRY(MoveFileExA(self->tmp,self->path,MOVEFILE_REPLACE_EXISTING)); // rename won't replace an existing file on windows
+#else
+  TRY(0==rename(self->tmp,self->path));
+#endif
+  return 1;
+Error:
+  return 0;
+}
+
+/** Writes out everything muxed so far and pushes it to disk.
+    For muxers that buffer a fragment (mp4 with frag_custom), this closes the
+    fragment in progress.  Call with the muxer lock held.
+ */
+static int flush_fragment(ndio_ffmpeg_t self)
+{ int err=0;
+  if(self->fmt->oformat->flags&AVFMT_ALLOW_FLUSH)
+    err=av_write_frame(self->fmt,NULL);
+  avio_flush(self->fmt->pb);
+  self->frag_n=0;
+  self->frag_t=av_gettime();
+  return err<0?err:0;
+}
+
+/** Flushes once enough frames or time have gone by since the last flush.
+    Call with the muxer lock held.
+ */
+static int maybe_flush(ndio_ffmpeg_t self)
+{ if(!self->frag_frames && !self->frag_usec)
+    return 0;
+  ++self->frag_n;
+  if( (self->frag_frames && self->frag_n>=self->frag_frames)
+    ||(self->frag_usec   && av_gettime()-self->frag_t>=self->frag_usec))
+    return flush_fragment(self);
+  return 0;
+}
+
+/** Rescales an encoded packet's timestamps to its stream and hands it to the muxer.
+    Safe to call concurrently.  The packet is released.
+ */
+static int mux(ndio_ffmpeg_t self, enc_t *enc, AVPacket *p)
+{ AVStream *stream=self->fmt->streams[enc->istream];
+  int err;
+  if (p->pts != AV_NOPTS_VALUE)
+    p->pts = av_rescale_q(p->pts, enc->cctx->time_base, stream->time_base);
+  if (p->dts != AV_NOPTS_VALUE)
+    p->dts = av_rescale_q(p->dts, enc->cctx->time_base, stream->time_base);
+  p->stream_index=enc->istream;
+  mutex_lock(self->mux);
+  err=av_interleaved_write_frame(self->fmt,p);
+  if(enc==self->enc)
+  { self->nframes++; // at the moment, mostly just use this to record that we did write something.
+    if(err>=0)
+      err=maybe_flush(self);
+  }
+  mutex_unlock(self->mux);
+  av_free_packet(p);
+  AVTRY(err,"Failed to write packet.");
+  return 1;
+Error:
+  return 0;
+}
+
+/** Encodes the input frame, outputing any resulting packets to the encoder's output stream.
+ *
+ *  Safe to call concurrently for different encoders.  Writes to the muxer are serialized.
+ *
+ *  \param[in]      file    Output file context.  Passed in for logging purposes.
+ *  \param[in]      enc     The encoder.
+ *  \param[in]      packet  Address of init'd (maybe pre-allocated) packet.
+ *  \param[in]      frame   The video frame to encode.
+ *  \param[out] got_packet  1 if encoding yielded a packet, 0 otherwise.
+ */
+static int push(ndio_t file, enc_t *enc, AVPacket *p, AVFrame *frame, int *got_packet)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  *got_packet=0;
+  AVTRY(avcodec_encode_video2(enc->cctx,p,frame,got_packet), frame?"Failed to encode frame.":"Failed to encode terminating frame.");
+  if(*got_packet)
+    TRY(mux(self,enc,p));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Flushes frames, writes the footer and closes the output file. */
+static int close_writer(ndio_t file)
+{ ndio_ffmpeg_t self;
+  int i;
+  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
+  TRY(self->base || CCTX(self)->codec); // codec might not have been opened
+  if(self->nframes)
+  { for(i=0;i<self->nenc;++i)
+    { AVCodecContext *cctx=self->enc[i].cctx;
+      if(cctx->codec->capabilities & CODEC_CAP_DELAY)
+      { AVPacket p={0};
+        int got_packet=1;
+        av_init_packet(&p);
+        while(got_packet)
+          TRY(push(file,self->enc+i,&p,NULL,&got_packet));
+      }
+    }
+    TRY(meta_write(self));
+    AVTRY(av_write_trailer(self->fmt),"Failed to write trailer.");
+  }
+  avio_close(self->fmt->pb);
+  self->fmt->pb=0;
+  TRY(finish_append(self));
+  return 1;
+Error:
+  if(self->fmt->pb) avio_close(self->fmt->pb);
+  self->fmt->pb=0;
+  if(self->tmp) remove(self->tmp); // leave the original untouched
+  return 0;
+}
+
+/** Adds an output stream for \a codec.
+    \returns the new stream's index, or -1 on failure.
+ */
+static int add_stream(ndio_ffmpeg_t self, AVCodec *codec)
+{ AVStream *st;
+  TRY(st=avformat_new_stream(self->fmt,codec));
+  st->codec->codec=codec;
+  st->codec->codec_id=codec->id;
+  return st->index;
+Error:
+  return -1;
+}
+
+/** Replaces the encoder on output stream \a istream with \a codec.
+    The stream's codec context is reset to the new encoder's defaults.
+ */
+static int select_encoder(ndio_ffmpeg_t self, int istream, AVCodec *codec)
+{ AVCodecContext *cctx=self->fmt->streams[istream]->codec;
+  if(cctx->codec==codec)
+    return 1;
+  if(avformat_query_codec(self->fmt->oformat,codec->id,FF_COMPLIANCE_NORMAL)==0)
+    FAIL("The output container can not hold the requested codec.");
+  if(cctx->priv_data) // holds the private options of the previous encoder
+  { av_opt_free(cctx->priv_data);
+    av_freep(&cctx->priv_data);
+  }
+  AVTRY(avcodec_get_context_defaults3(cctx,codec),"Failed to reset the codec context.");
+  cctx->codec_id=codec->id;
+  cctx->codec=codec;
+  return 1;
+Error:
+  return 0;
+}
+
+/** Allocates the encoder's input frame and the conversion from source planes. */
+static int alloc_input(enc_t *enc)
+{ AVCodecContext *cctx=enc->cctx;
+  TRY(enc->raw=avcodec_alloc_frame());
+  AVTRY(av_image_alloc(enc->raw->data,enc->raw->linesize,enc->width,enc->height,cctx->pix_fmt,FRAME_ALIGN),"Failed to allocate frame.");
+  if(enc->role==ENC_ALL)
+    TRY(enc->sws=sws_getContext( // same size: odd sizes are padded, not resampled (see pad_frame())
+      enc->src_w,enc->src_h,enc->src_pixfmt,
+      enc->src_w,enc->src_h,cctx->pix_fmt,
+      SWS_BICUBIC,NULL,NULL,NULL));
+  else
+    neutral_chroma(enc->raw,cctx->pix_fmt,enc->height);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Sets the GOP structure for a read-back access pattern (see \ref ndio-ffmpeg-profiles).
+    A NULL \a profile leaves the encoder's defaults.
+ */
+static int apply_profile(enc_t *enc, AVCodecContext *cctx, const char *profile)
+{ if(!profile)
+    return 1;
+  if(streq(profile,"archive"))
+  { cctx->gop_size=250;
+    cctx->max_b_frames=3;
+    cctx->refs=4;
+  } else if(streq(profile,"random-access"))
+  { cctx->gop_size=8;
+    cctx->max_b_frames=2;
+    cctx->refs=1;
+    cctx->flags|=CODEC_FLAG_CLOSED_GOP;
+    TRY(av_dict_set(&enc->opts,"b-pyramid","none",0)>=0); // B-frames are never references, so a seek never decodes one it doesn't show
+  } else if(streq(profile,"intra"))
+  { cctx->gop_size=1;
+    cctx->max_b_frames=0;
+  } else
+    FAIL("Unknown profile.  Expected archive, random-access or intra.");
+  return 1;
+Error:
+  return 0;
+}
+
+/** Configures and opens the encoder for \a enc's output stream.
+    \param[in] codec  The encoder to use.  NULL keeps the encoder already on the stream.
+    \param[in] role   Which part of the source planes the encoder receives.
+ */
+static int open_encoder(ndio_ffmpeg_t self, enc_t *enc, AVCodec *codec, int role, int width, int height, int fps, int src_pixfmt, const ndio_ffmpeg_params_t *params)
+{ AVCodecContext *cctx=self->fmt->streams[enc->istream]->codec;
+  AVDictionary *user=0;
+  if(codec)
+    TRY(select_encoder(self,enc->istream,codec));
+  codec=(AVCodec*)cctx->codec;
+  enc->cctx=cctx;
+  enc->role=role;
+  enc->src_w=width;
+  enc->src_h=height;
+  enc->src_pixfmt=src_pixfmt;
+  enc->width =cctx->width =even(width);
+  enc->height=cctx->height=even(height);
+  if(enc->width!=width || enc->height!=height) // so the reader can crop the padding
+    TRY(meta_setf(self,"size","%d,%d",width,height));
+  cctx->time_base.num=1;
+  cctx->time_base.den=fps;
+  cctx->gop_size=12;
+  TRY(apply_profile(enc,cctx,params->profile));
+  if(params->chunk) // chunks start on keyframes that nothing before them refers to
+  { cctx->flags|=CODEC_FLAG_CLOSED_GOP;
+    if(params->chunk>0)
+      cctx->gop_size=params->chunk;
+  }
+  if(params->threads>0)
+    cctx->thread_count=params->threads;
+  else
+  { cctx->thread_count=budget_join();
+    ++self->nshares;
+  }
+  TRY(PIX_FMT_NONE!=(cctx->pix_fmt=choose_pixfmt(codec,role==ENC_ALL?src_pixfmt:PIX_FMT_GRAY8)));
+  if(role!=ENC_ALL && !is_luma8(cctx->pix_fmt))
+    FAIL("Encoder does not accept 8-bit luma, so it can't hold 8-bit planes packed from u16 data.");
+
+  if(codec->id==CODEC_ID_FFV1)
+  { cctx->level=3;                  // FFV1 version 3: multi-slice, per-slice CRCs
+    { const char *n=meta_get(self,"ffv1_slices"); // appending must match the slice layout in the stream header
+      cctx->slices=n?atoi(n):ffv1_slices(cctx->thread_count);
+    }
+    cctx->thread_type=FF_THREAD_SLICE;
+    cctx->gop_size=1;               // every frame is a keyframe, so any plane is a cheap seek
+    cctx->strict_std_compliance=FF_COMPLIANCE_EXPERIMENTAL;
+  } else
+  {
+    #define SET(k,v) \
+      if(v) AVTRY(av_dict_set(&enc->opts,(k),(v),0),"Failed to set options.")
+    SET("crf"   ,params->crf);
+    SET("preset",params->preset);
+    SET("tune"  ,params->tune);
+    #undef SET
+  }
+
+  TRY(parse_options(&user,params->codec_options));
+  av_dict_copy(&enc->opts,user,0);
+  av_dict_copy(&enc->optsave,enc->opts,0);
+  AVTRY(avcodec_open2(cctx,codec,&enc->opts),"Failed to initialize encoder.");
+  TRY(check_options(user,enc->opts,"codec"));
+  if(codec->id==CODEC_ID_FFV1)
+    TRY(meta_setf(self,"ffv1_slices","%d",cctx->slices)); // may have been set by an option
+  TRY(alloc_input(enc));
+  av_dict_free(&user);
+  return 1;
+Error:
+  if(user) av_dict_free(&user);
+  return 0;
+}
+
+/** Opens a private encoder, configured like \a enc's, for encoding one segment of planes.
+    Segment encoders start fresh, so every segment begins with a keyframe and
+    can be decoded without the others.
+    \param[in] nthreads  Threads for the segment encoder.
+ */
+static int open_segment(enc_t *seg, const enc_t *enc, int nthreads)
+{ const AVCodecContext *src=enc->cctx;
+  AVCodecContext *c=0;
+  AVDictionary *opts=0;
+  *seg=*enc;
+  seg->cctx=0;
+  seg->sws=0;
+  seg->raw=0;
+  seg->opts=0;
+  seg->optsave=0;
+  TRY(c=avcodec_alloc_context3((AVCodec*)src->codec));
+  c->width                =src->width;
+  c->height               =src->height;
+  c->time_base            =src->time_base;
+  c->gop_size             =src->gop_size;
+  c->max_b_frames         =src->max_b_frames;
+  c->refs                 =src->refs;
+  c->pix_fmt              =src->pix_fmt;
+  c->level                =src->level;
+  c->slices               =src->slices;   // FFV1 records the slice layout in the stream header, so it must match
+  c->thread_type          =src->thread_type;
+  c->strict_std_compliance=src->strict_std_compliance;
+  c->flags                =src->flags|CODEC_FLAG_CLOSED_GOP;
+  c->thread_count         =nthreads;
+  av_dict_copy(&opts,enc->optsave,0);
+  AVTRY(avcodec_open2(c,src->codec,&opts),"Failed to initialize segment encoder.");
+  av_dict_free(&opts);
+  seg->cctx=c;
+  TRY(alloc_input(seg));
+  return 1;
+Error:
+  if(opts) av_dict_free(&opts);
+  if(c)
+  { avcodec_close(c);
+    av_free(c);
+  }
+  seg->cctx=0;
+  return 0;
+}
+
+/** Releases a segment encoder opened by open_segment(). */
+static void close_segment(enc_t *seg)
+{ if(seg->cctx)
+  { avcodec_close(seg->cctx);
+    av_free(seg->cctx);
+  }
+  if(seg->sws) sws_freeContext(seg->sws);
+  if(seg->raw)
+  { av_freep(&seg->raw->data[0]);
+    av_free(seg->raw);
+  }
+}
+
+/** Source planes for write_volume(), after the array's dimensions have been mapped to w,h,d,c. */
+typedef struct _src_t
+{ const uint8_t *data;
+  int            w,h,d,c;
+  int            pixfmt;      ///< Pixel format of a plane as seen by swscale.
+  int            linestride;
+  size_t         pixelstride; ///< Bytes from one pixel to the next along a line.
+  size_t         planestride,colorstride;
+  int            type;        ///< nd type of the samples.  Float and 32/64-bit planes are quantized to u16 as they're packed (see quantize_row()).
+  double         qlo,qk;      ///< Quantized planes: samples x become (x-qlo)*qk.
+  double        *qplanes;     ///< Quantized planes: per-plane qlo,qk pairs overriding the above, or NULL.
+} src_t;
+
+/** Nonzero if samples of nd type \a type must be quantized to u16 to be encoded. */
+static int quantized(int type)
+{ return type==nd_u32 || type==nd_u64 || type==nd_f32 || type==nd_f64;
+}
+
+/** Quantizes \a n samples of nd type \a type at \a src to u16 as (x-lo)*k. */
+static void quantize_row(int type, uint16_t *dst, const uint8_t *src, int n, double lo, double k)
+{ switch(type)
+  { case nd_f32: kern_f32_u16(dst,(const float*)   src,n,(float)lo,(float)k); break;
+    case nd_f64: kern_f64_u16(dst,(const double*)  src,n,lo,k); break;
+    case nd_u32: kern_u32_u16(dst,(const uint32_t*)src,n,lo,k); break;
+    case nd_u64: kern_u64_u16(dst,(const uint64_t*)src,n,lo,k); break;
+    default:;
+  }
+}
+
+/** Finds the \a lo and \a hi percentiles of the intensities in a sample of up to 16 source planes. */
+static int auto_window(const src_t *src, double plo, double phi, int *lo, int *hi)
+{ uint32_t *hist=0;
+  uint64_t n=0,acc=0;
+  int i,x,y,step=src->d>16?src->d/16:1;
+  TRY(hist=(uint32_t*)calloc(65536,sizeof(uint32_t)));
+  for(i=0;i<src->d;i+=step)
+    for(y=0;y<src->h;++y)
+    { kern_u16_hist(hist,(const uint16_t*)(src->data+src->planestride*i+src->linestride*y),src->w);
+      n+=src->w;
+    }
+  *lo=0;
+  *hi=65535;
+  for(x=0;x<65536;++x)
+  { acc+=hist[x];
+    if(acc<=plo/100.0*n)  *lo=x;
+    if(acc< phi/100.0*n)  *hi=x+1;
+  }
+  if(*hi<=*lo) *hi=*lo+1;
+  free(hist);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Sets up the u16 to u8 mapping for an ENC_LUT encoder from the window, gamma and lut parameters.
+    Records what the reader needs to invert it in the plugin metadata.
+ */
+static int make_window(ndio_ffmpeg_t self, enc_t *enc, const src_t *src, const ndio_ffmpeg_params_t *params)
+{ double gamma=params->gamma>0?params->gamma:1.0,vst[3];
+  const char *window=params->window?params->window:"auto"; // anscombe alone
+  int lo=0,hi=65535;
+  if(src->c!=1 || src->pixfmt!=PIX_FMT_GRAY16)
+    FAIL("Intensity windows require single channel 16-bit data.");
+  if(params->lut) // inverse is the mean input for each output level, with the saturated tails left out
+  { uint16_t inv[256];
+    char buf[256*6+1]={0},*c=buf;
+    int v;
+    TRY(enc->lut=(uint8_t*)malloc(65536));
+    memcpy(enc->lut,params->lut,65536);
+    lut_range(enc->lut,&lo,&hi);
+    invert_lut(enc->lut,lo,hi,inv);
+    for(v=0;v<256;++v)
+      c+=sprintf(c,v?",%d":"%d",inv[v]);
+    TRY(meta_set(self,"lut_inverse",buf));
+    return 1;
+  }
+  if(params->anscombe && !parse_anscombe(params->anscombe,vst))
+    FAIL("Expected the Anscombe parameters as \"gain,offset,sigma\", with gain > 0.");
+  if(!strncmp(window,"auto",4))
+  { double plo=0.1,phi=99.9;
+    sscanf(window,"auto,%lf,%lf",&plo,&phi);
+    TRY(auto_window(src,plo,phi,&lo,&hi));
+  } else
+    TRY(2==sscanf(window,"%d,%d",&lo,&hi));
+  TRY(0<=lo && lo<hi && hi<=65535);
+  if(gamma==1.0 && hi-lo>255 && !params->anscombe) // linear: computed on the fly
+  { enc->win_lo=(uint16_t)lo;
+    enc->win_scale=(uint16_t)((256u<<16)/(unsigned)(hi-lo+1)); // hi maps to 255; fits since hi-lo>255
+  } else
+  { TRY(enc->lut=(uint8_t*)malloc(65536));
+    if(!window_lut(enc->lut,lo,hi,gamma,params->anscombe?vst:NULL))
+      FAIL("The window is empty after the Anscombe transform.");
+  }
+  TRY(meta_setf(self,"window","%d,%d,%g",lo,hi,gamma));
+  if(params->anscombe)
+    TRY(meta_setf(self,"anscombe","%.9g,%.9g,%.9g",vst[0],vst[1],vst[2]));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Append mode: opens encoders that continue the streams already in the file.
+    How the planes were encoded is recovered from the plugin metadata, and the
+    new planes must encode to the same frame size and pixel format.
+ */
+static int init_append(ndio_ffmpeg_t self, const src_t *src, int fps, const ndio_ffmpeg_params_t *params)
+{ const char *split=meta_get(self,"split16"),
+             *win  =meta_get(self,"window"),
+             *chan =meta_get(self,"channels");
+  int i;
+  if(meta_get(self,"tiles"))
+    FAIL("Appending to tiled files isn't supported.");
+  if(split)
+  { int hi,lo;
+    if(src->c!=1 || src->pixfmt!=PIX_FMT_GRAY16)
+      FAIL("split16 requires single channel 16-bit data.");
+    TRY(2==sscanf(split,"%d,%d",&hi,&lo));
+    NEW(enc_t,self->enc,2);
+    memset(self->enc,0,2*sizeof(enc_t));
+    self->nenc=2;
+    self->enc[0].istream=hi; self->enc[0].role=ENC_HI;
+    self->enc[1].istream=lo; self->enc[1].role=ENC_LO;
+  } else if(chan)
+  { char *copy,*bookmark,*token;
+    int n=1;
+    for(token=(char*)chan;*token;++token)
+      n+=(*token==',');
+    if(!params->channel_streams || src->c!=n)
+      FAIL("The file holds one stream per channel.  Appending requires channel_streams and the same number of channels.");
+    NEW(enc_t,self->enc,n);
+    memset(self->enc,0,n*sizeof(enc_t));
+    TRY(copy=bookmark=strdup(chan));
+    for(i=0;i<n && (token=strsep(&bookmark,","))!=NULL;++i)
+    { self->enc[i].istream=atoi(token);
+      self->enc[i].channel=i;
+      self->enc[i].role=ENC_ALL;
+    }
+    free(copy);
+    self->nenc=n;
+    TRY(i==n);
+  } else
+  { NEW(enc_t,self->enc,1);
+    memset(self->enc,0,sizeof(enc_t));
+    self->nenc=1;
+    self->enc[0].istream=self->istream;
+    self->enc[0].role=ENC_ALL;
+    if(win || meta_get(self,"lut_inverse"))
+    { ndio_ffmpeg_params_t p=*params;
+      if(win)
+      { p.window=(char*)win;
+        p.lut=0;
+        p.anscombe=(char*)meta_get(self,"anscombe"); // same "gain,offset,sigma" form
+        TRY(1==sscanf(win,"%*d,%*d,%lf",&p.gamma));
+      } else if(!p.lut)
+        FAIL("The file was written through a lookup table.  Appending requires the same table in the lut parameter.");
+      TRY(make_window(self,self->enc,src,&p));
+      self->enc[0].role=ENC_LUT;
+    }
+  }
+  for(i=0;i<self->nenc;++i)
+  { enc_t *e=self->enc+i;
+    AVCodecContext *c;
+    AVCodec *codec;
+    int w,h,pixfmt,nx,same;
+    uint8_t *x;
+    TRY(0<=e->istream && e->istream<(int)self->fmt->nb_streams);
+    c=self->fmt->streams[e->istream]->codec;
+    w=c->width; h=c->height; pixfmt=c->pix_fmt;
+    TRY(codec=avcodec_find_encoder(c->codec_id));
+    x=c->extradata;             // the file's stream header.  The encoder makes its own.
+    nx=c->extradata_size;
+    c->extradata=0;
+    c->extradata_size=0;
+    if(!open_encoder(self,e,codec,e->role,src->w,src->h,fps,src->pixfmt,params))
+    { av_freep(&c->extradata);
+      c->extradata=x;
+      c->extradata_size=nx;
+      goto Error;
+    }
+    same=(c->extradata_size==nx) && (!nx || !memcmp(c->extradata,x,nx));
+    av_freep(&c->extradata);    // keep the file's, so a muxer writing it again at the trailer writes the same bytes
+    c->extradata=x;
+    c->extradata_size=nx;
+    if(!same) // e.g. FFV1 version 3 records its slices and coder in the stream header
+      FAIL("The encoder's stream header differs from the one in the file, so appended planes couldn't be decoded.  Append with the same codec options.");
+    if(e->width!=w || e->height!=h || c->pix_fmt!=pixfmt)
+      FAIL("Appended planes must have the same size and type as the planes already in the file.");
+    e->pts=self->base[e->istream];
+  }
+  return 1;
+Error:
+  return 0;
+}
+
+/** Sets up one gray encoder per channel, for ndio_ffmpeg_params_t::channel_streams.
+    Channel 0 goes to stream 0.  The others get streams of their own, with the same codec.
+ */
+static int init_channels(ndio_ffmpeg_t self, const src_t *src, int fps, const ndio_ffmpeg_params_t *params)
+{ AVCodec *codec;
+  char *list=0,*t;
+  int i;
+  if(params->split16 || params->window || params->lut || params->anscombe)
+    FAIL("channel_streams can't be combined with split16, window, lut or anscombe.");
+  TRY(codec=params->lossless?avcodec_find_encoder(CODEC_ID_FFV1)
+                            :(AVCodec*)CCTX(self)->codec);
+  NEW(enc_t,self->enc,src->c);
+  memset(self->enc,0,src->c*sizeof(enc_t));
+  self->nenc=src->c;
+  NEW(char,list,12*src->c+1);
+  for(i=0,t=list;i<src->c;++i)
+  { enc_t *e=self->enc+i;
+    e->channel=i;
+    if(i)
+      TRY((e->istream=add_stream(self,codec))>0);
+    TRY(open_encoder(self,e,codec,ENC_ALL,src->w,src->h,fps,src->pixfmt,params));
+    t+=sprintf(t,i?",%d":"%d",e->istream);
+  }
+  TRY(meta_set(self,"channels",list));
+  free(list);
+  return 1;
+Error:
+  SAFEFREE(list);
+  return 0;
+}
+
+/** Sets up one encoder per tile, for ndio_ffmpeg_params_t::tile (see \ref ndio-ffmpeg-tiles).
+    Tile k, counting in row-major order, goes to stream k.
+ */
+static int init_tiles(ndio_ffmpeg_t self, const src_t *src, int fps, const ndio_ffmpeg_params_t *params)
+{ AVCodec *codec;
+  int k,tw,th,cols,rows;
+  if(src->c!=1 || params->split16 || params->window || params->lut || params->anscombe)
+    FAIL("tile requires single channel data, and can't be combined with split16, window, lut or anscombe.");
+  if(!(2==sscanf(params->tile,"%d,%d",&tw,&th) && tw>0 && th>0))
+    FAIL("Expected the tile size as \"w,h\".");
+  if(tw>src->w) tw=src->w;
+  if(th>src->h) th=src->h;
+  if(tw<MIN_SWS_WIDTH || (src->w%tw && src->w%tw<MIN_SWS_WIDTH))
+    FAIL("Every tile, including those on the right edge, must be at least 8 pixels wide.");
+  cols=(src->w+tw-1)/tw;
+  rows=(src->h+th-1)/th;
+  TRY(codec=params->lossless?avcodec_find_encoder(CODEC_ID_FFV1)
+                            :(AVCodec*)CCTX(self)->codec);
+  NEW(enc_t,self->enc,cols*rows);
+  memset(self->enc,0,cols*rows*sizeof(enc_t));
+  self->nenc=cols*rows;
+  for(k=0;k<self->nenc;++k)
+  { enc_t *e=self->enc+k;
+    e->x0=(k%cols)*tw;
+    e->y0=(k/cols)*th;
+    if(k)
+      TRY((e->istream=add_stream(self,codec))==k);
+    TRY(open_encoder(self,e,codec,ENC_ALL,
+                     (src->w-e->x0<tw)?(src->w-e->x0):tw,
+                     (src->h-e->y0<th)?(src->h-e->y0):th,
+                     fps,src->pixfmt,params));
+  }
+  TRY(meta_setf(self,"tiles","%d,%d,%d,%d",src->w,src->h,tw,th));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Intializes the encoders if necessary. */
+static int maybe_init_encoders(ndio_ffmpeg_t self, const src_t *src, int fps, const ndio_ffmpeg_params_t *params)
+{ if(self->nenc)
+    return 1;
+  self->chunk=params->chunk;
+  if(self->base)
+    return init_append(self,src,fps,params);
+  if(params->tile)
+    TRY(init_tiles(self,src,fps,params));
+  else if(params->channel_streams && src->c>1)
+    TRY(init_channels(self,src,fps,params));
+  else if(params->split16)
+  { AVCodec *hi=0,*lo=0;
+    if(src->c!=1 || src->pixfmt!=PIX_FMT_GRAY16)
+      FAIL("split16 requires single channel 16-bit data.");
+    if(params->hi_codec)
+      TRY(hi=avcodec_find_encoder_by_name(params->hi_codec));
+    TRY(lo=avcodec_find_encoder_by_name(params->lo_codec?params->lo_codec:"ffv1"));
+    NEW(enc_t,self->enc,2);
+    memset(self->enc,0,2*sizeof(enc_t));
+    self->nenc=2;
+    self->enc[0].istream=0;
+    TRY((self->enc[1].istream=add_stream(self,lo))>0);
+    TRY(open_encoder(self,self->enc+0,hi,ENC_HI,src->w,src->h,fps,src->pixfmt,params));
+    TRY(open_encoder(self,self->enc+1,lo,ENC_LO,src->w,src->h,fps,src->pixfmt,params));
+    TRY(meta_setf(self,"split16","%d,%d",self->enc[0].istream,self->enc[1].istream));
+  } else
+  { int windowed=params->window || params->lut || params->anscombe;
+    NEW(enc_t,self->enc,1);
+    memset(self->enc,0,sizeof(enc_t));
+    self->nenc=1;
+    if(windowed)
+      TRY(make_window(self,self->enc,src,params));
+    TRY(open_encoder(self,self->enc,params->lossless?avcodec_find_encoder(CODEC_ID_FFV1):NULL,
+                     windowed?ENC_LUT:ENC_ALL,src->w,src->h,fps,src->pixfmt,params));
+  }
+  if(params->profile)
+    TRY(meta_set(self,"profile",params->profile));
+  if(params->chunk>0)
+    TRY(meta_setf(self,"chunk","%d",params->chunk));
+  else if(params->chunk<0)
+    TRY(meta_set(self,"chunk","write")); // each write adds its first frame; see meta_note_write()
+  if(params->scale!=0.0 && !self->qmode) // quantized writes record their own
+    TRY(meta_setf(self,"norm","%.9g,%.9g",params->scale,params->offset));
+  TRY(init_fragments(self,params));
+  TRY(write_header(self,params));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Opens the file at \a path according to the specified \a mode. */
 static void* open_ffmpeg(ndio_fmt_t *fmt, const char* path, const char *mode)
 {
   switch(mode[0])
-  { case 'r': return open_reader(path);
+  { case 'r': return open_reader(path,(ndio_ffmpeg_params_t*)ndioFormatGet(fmt));
     case 'w': return open_writer(path);
+    case 'a': return open_appender(path,(ndio_ffmpeg_params_t*)ndioFormatGet(fmt));
     default:
       FAIL("Could not recognize mode.");
   }
@@ -484,17 +2262,51 @@ Error:
 /** Closes the file and performs any necessary cleanup */
 static void close_ffmpeg(ndio_t file)
 { ndio_ffmpeg_t self;
+  int i;
   if(!file) return;
   if(!(self=(ndio_ffmpeg_t)ndioContext(file)) ) return;
+  if(self->parts)
+    for(i=1;i<self->pc*self->pt;++i)
+      ndioClose(self->parts[i]);
   if(self->fmt)
   { if(self->fmt->oformat)
-      close_writer(file);
-    if(CCTX(self))  avcodec_close(CCTX(self));
-    avformat_free_context(self->fmt);
+    { close_writer(file);
+      for(i=0;i<self->nenc;++i)
+        avcodec_close(self->fmt->streams[self->enc[i].istream]->codec);
+      if(!self->nenc) avcodec_close(CCTX(self));
+      avformat_free_context(self->fmt);
+    } else
+      release_reader(self);
   }
+  for(i=0;i<self->nenc;++i)
+  { enc_t *e=self->enc+i;
+    if(e->opts) av_dict_free(&e->opts);
+    if(e->optsave) av_dict_free(&e->optsave);
+    if(e->sws)  sws_freeContext(e->sws);
+    if(e->lut)  free(e->lut);
+    if(e->raw)
+    { av_freep(&e->raw->data[0]);
+      av_free(e->raw);
+    }
+  }
+  SAFEFREE(self->enc);
+  release_shares(self);
+  if(self->mux)     mutex_free(self->mux);
+  if(self->meta)    av_dict_free(&self->meta);
   if(self->opts)    av_dict_free(&self->opts);
+  if(self->decopts) av_dict_free(&self->decopts);
+  SAFEFREE(self->base);
+  SAFEFREE(self->parts);
+  SAFEFREE(self->path);
+  SAFEFREE(self->tmp);
   if(self->raw)     av_free(self->raw);
   if(self->sws)     sws_freeContext(self->sws);
+  if(self->stage)
+  { av_freep(&self->stage->data[0]);
+    av_free(self->stage);
+  }
+  ndfree(self->u16);
+  SAFEFREE(self->norm);
   free(self);
 }
 
@@ -548,14 +2360,28 @@ static nd_t shape_ffmpeg(ndio_t file)
     So we silently ignore failure?
      */
     av_seek_frame(self->fmt,self->istream,0,AVSEEK_FLAG_BACKWARD/*flags*/);
+    reset_queues(self);
   }
-  d=(int)self->nframes;
-  w=cctx->width;
-  h=cctx->height;
+  refresh(self); // follow mode: count frames that arrived since open
+  d=(int)frames(self);
+  w=self->w;
+  h=self->h;
   TRY(pixfmt_to_nd_type(pixfmt_to_output_pixfmt(cctx->pix_fmt),&type,&c));
+  if(self->nch>1 && !self->tcols)
+    c=self->nch;
+  if(self->parts)
+  { nd_t out=ndinit();
+    size_t shape[]={w,h,d,self->pc,self->pt};
+    ndcast(out,type);
+    ndreshape(out,countof(shape),shape);
+    return out;
+  }
   { nd_t out=ndinit();
     size_t k=4,shape[]={w,h,d,c};
-    k=pack(shape,countof(shape));
+    if(self->roi) // regions may be one pixel wide or high, so keep w,h,d
+      k=(c>1)?4:3;
+    else if(self->nch<2 || self->tcols) // several streams keep w,h,d,c so the stream is always dimension 3
+      k=pack(shape,countof(shape));
     ndcast(out,type);
     ndreshape(out,(unsigned)k,shape);
     return out;
@@ -568,10 +2394,10 @@ Error:
 /// @cond DEFINES
 #if 0
 #define DEBUG_PRINT_PACKET_INFO \
-    printf("Packet - pts:%5d dts:%5d (%5d) - flag: %1d - finished: %3d - Frame pts:%5d %5d\n",   \
-        (int)packet.pts,(int)packet.dts,iframe,                                                  \
-        packet.flags,finished,                                                                   \
-        (int)self->raw->pts,(int)self->raw->best_effort_timestamp)
+    printf("Packet - stream:%d pts:%5d dts:%5d (%5d) - flag: %1d - finished: %3d - Frame pts:%5d %5d\n",   \
+        istream,(int)packet->pts,(int)packet->dts,(int)iframe,                                       \
+        packet->flags,yielded,                                                                       \
+        (int)frame->pts,(int)frame->best_effort_timestamp)
 #else
 #define DEBUG_PRINT_PACKET_INFO
 #endif
@@ -586,36 +2412,338 @@ static void zero(AVFrame *p)
         memset(p->data[j]+p->linesize[j]*i,0,p->linesize[j]);
 }
 
-/** Parse next packet from current video.
-    Advances to the next frame.
-
-    Caller is responsible for passing the correct, pre-allocated plane.
+/** Gets the next packet for stream \a istream.
+    Packets for other wanted streams that are demuxed along the way get queued.
+    The rest are dropped.  At the end of the file, the packet is empty (which flushes the decoder).
+    \param[out] out  Points to the packet.  It's owned by the stream's queue and stays valid until the next call.
+ */
+static int next_packet(ndio_t file, int istream, AVPacket **out)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  pktq_t *q=self->q+istream;
+  av_free_packet(&q->last); // For rawvideo, the packet.data is referenced by raw->data, so free here.
+  *out=&q->last;
+  if(q->head)
+  { AVPacketList *e=q->head;
+    if(!(q->head=e->next)) q->tail=0;
+    q->last=e->pkt;
+    av_free(e);
+    return 1;
+  }
+  while(1)
+  { AVPacket p={0};
+    int err=av_read_frame(self->fmt,&p); // !!NOTE: see docs on packet.convergence_duration for proper seeking
+    if(err<0 && self->scout && self->target>=self->nframes && wait_for(self,self->target)) // follow mode: the wanted frame arrived, so try again
+      continue;                                                                                   // otherwise end of file flushes the decoder as usual
+    AVTRY(err,"Failed to read frame.");
+    if(p.size==0 || p.stream_index==istream) // p.size==0 usually means EOF
+    { q->last=p;
+      return 1;
+    }
+    if(self->q[p.stream_index].wanted)
+    { pktq_t *o=self->q+p.stream_index;
+      AVPacketList *e=0;
+      AVTRY(av_dup_packet(&p),"Failed to copy packet.");
+      TRY(e=(AVPacketList*)av_mallocz(sizeof(*e)));
+      e->pkt=p;
+      if(o->tail) o->tail->next=e;
+      else        o->head=e;
+      o->tail=e;
+    } else
+      av_free_packet(&p);
+  }
+Error:
+  return 0;
+}
 
-    \returns 1 on success, 0 otherwise.
+/** Frame index to timestamp in stream \a istream's time base.  Frames are
+    taken to be evenly spaced at the stream's frame rate, from its start time.
+    Stream time bases are 1/fps only for some containers (nut, avi); mp4 and
+    mkv use finer clocks, so the index can't be used as a timestamp directly.
  */
-static int next(ndio_t file,nd_t plane,int64_t iframe, int64_t ichan)
-{ ndio_ffmpeg_t self;
-  AVPacket packet = {0};
-  int yielded = 0;
-  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
+static int64_t frame_to_ts(ndio_ffmpeg_t self, int istream, int64_t iframe)
+{ const AVStream *st=self->fmt->streams[istream];
+  const AVRational period={st->r_frame_rate.den,st->r_frame_rate.num};
+  const int64_t t0=(st->start_time!=AV_NOPTS_VALUE)?st->start_time:0;
+  if(period.num<=0 || period.den<=0)
+    return iframe;
+  return t0+av_rescale_q(iframe,period,st->time_base);
+}
+
+/** Timestamp in stream \a istream's time base to frame index (see frame_to_ts()).  AV_NOPTS_VALUE passes through. */
+static int64_t ts_to_frame(ndio_ffmpeg_t self, int istream, int64_t ts)
+{ const AVStream *st=self->fmt->streams[istream];
+  const AVRational period={st->r_frame_rate.den,st->r_frame_rate.num};
+  const int64_t t0=(st->start_time!=AV_NOPTS_VALUE)?st->start_time:0;
+  if(ts==AV_NOPTS_VALUE || period.num<=0 || period.den<=0)
+    return ts;
+  return av_rescale_q(ts-t0,st->time_base,period);
+}
+
+/** Decodes stream \a istream into \a frame until frame \a iframe (or a later one) is reached. */
+static int decode_to(ndio_t file, int istream, AVFrame *frame, int64_t iframe)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  AVCodecContext *cctx=self->fmt->streams[istream]->codec;
+  AVPacket *packet;
+  int yielded=0,ok;
+  self->target=iframe;
   do
   { yielded=0;
-    av_free_packet( &packet ); // no op when packet is null
-    AVTRY(av_read_frame(self->fmt,&packet),"Failed to read frame.");   // !!NOTE: see docs on packet.convergence_duration for proper seeking
-    if(packet.stream_index!=self->istream)
-      continue;
-    AVTRY(avcodec_decode_video2(CCTX(self),self->raw,&yielded,&packet),NULL);
+    if(self->nch>1) mutex_lock(self->mux); // channel streams decode concurrently, but share the demuxer
+    ok=next_packet(file,istream,&packet);
+    if(self->nch>1) mutex_unlock(self->mux);
+    TRY(ok);
+    AVTRY(avcodec_decode_video2(cctx,frame,&yielded,packet),NULL);
     // Handle odd cases and debug
-    if(CCTX(self)->codec_id==CODEC_ID_RAWVIDEO)
-    { if(!yielded) zero(self->raw); // Emit a blank frame. Something off about the stream.  Raw should always yield.
+    if(cctx->codec_id==CODEC_ID_RAWVIDEO)
+    { if(!yielded) zero(frame); // Emit a blank frame. Something off about the stream.  Raw should always yield.
       yielded=1;
     }
     DEBUG_PRINT_PACKET_INFO;
-    if(!yielded && packet.size==0) // packet.size==0 usually means EOF
+    if(!yielded && packet->size==0) // packet.size==0 usually means EOF
         break;
-  } while(!yielded || self->raw->best_effort_timestamp<iframe);
+  } while(!yielded || ts_to_frame(self,istream,frame->best_effort_timestamp)<iframe);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Recombines the decoded high and low byte frames of a split16 file into \a plane. */
+static int unsplit(ndio_t file, nd_t plane)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const AVFrame *hi=self->raw,*lo=self->lo_raw;
+  const int lst=(int)ndstrides(plane)[1];
+  int y,w=self->w,h=self->h;
+  TRY(ndstrides(plane)[0]==2);
+  for(y=0;y<h;++y)
+    kern_u16_merge((uint16_t*)((uint8_t*)nddata(plane)+lst*y),
+                   hi->data[0]+hi->linesize[0]*(y+self->ry)+self->rx,
+                   lo->data[0]+lo->linesize[0]*(y+self->ry)+self->rx,w);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Maps the decoded 8-bit luma of a windowed file back to u16 in \a plane. */
+static int unwindow(ndio_t file, nd_t plane)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const AVFrame *f=self->raw;
+  const int lst=(int)ndstrides(plane)[1];
+  int y,w=self->w,h=self->h;
+  TRY(ndstrides(plane)[0]==2);
+  for(y=0;y<h;++y)
+    kern_u8_lut16((uint16_t*)((uint8_t*)nddata(plane)+lst*y),f->data[0]+f->linesize[0]*(y+self->ry)+self->rx,w,self->inv);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Points \a out at pixel (\a x,\a y) in each plane of \a f, a frame in pixel format \a fmt. */
+static void crop_planes(const AVFrame *f, int fmt, int x, int y, const uint8_t **out)
+{ const AVPixFmtDescriptor *d=av_pix_fmt_descriptors+fmt;
+  int i,n=0,l[4]={0};
+  for(i=0;i<d->nb_components;++i) // planes past these (e.g. a palette) are left alone
+    if(d->comp[i].plane+1>n)
+      n=d->comp[i].plane+1;
+  av_image_fill_linesizes(l,fmt,x); // bytes from the start of each line to column x
+  for(i=0;i<4;++i)
+    out[i]=(i<n)?f->data[i]+l[i]+f->linesize[i]*((i==1||i==2)?(y>>d->log2_chroma_h):y)
+                :f->data[i];
+}
+
+/** Converts the region (see ndio_ffmpeg_params_t::roi) of the decoded frame \a f into \a planes.
+    \a sws converts columns [cx,cx+cw) of the region's rows.  When that's wider
+    than the region, the conversion goes to \a stage and only the region's
+    columns are copied out.  Otherwise \a stage may be NULL.
+ */
+static void convert_region(ndio_ffmpeg_t self, struct SwsContext *sws, const AVFrame *f, int pxfmt,
+                           AVFrame *stage, uint8_t **planes, int *lines)
+{ const uint8_t *src[4],*from[4];
+  const enum PixelFormat fmt=pixfmt_to_output_pixfmt(pxfmt);
+  crop_planes(f,pxfmt,self->cx,self->ry,src);
+  if(!stage)
+  { sws_scale(sws,src,f->linesize,0,self->h,planes,lines);
+    return;
+  }
+  sws_scale(sws,src,f->linesize,0,self->h,stage->data,stage->linesize);
+  crop_planes(stage,fmt,self->rx-self->cx,0,from);
+  av_image_copy(planes,lines,from,stage->linesize,fmt,self->w,self->h);
+}
+
+/** Converts the decoded frame into the color planes \a planes.
+ *  When more columns are converted than the region holds, they go through \a stage (see convert_region()).
+ *
+ *  swscale writes straight into the caller's planes whether or not they are
+ *  aligned.  Staging unaligned planes through an aligned frame was tried, but
+ *  never measured against the direct conversion, so it isn't done.  Aligned
+ *  planes do pay off on the split16 read path, whose merge kernel picks
+ *  aligned loads and stores.  app/bench/aligned.c compares the two.
+ */
+static int convert(ndio_t file, uint8_t **planes, int *lines, int ichan)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const enum PixelFormat fmt=pixfmt_to_output_pixfmt(CCTX(self)->pix_fmt);
+  if(self->cw==self->w)
+  { convert_region(self,self->sws,self->raw,CCTX(self)->pix_fmt,NULL,planes,lines);
+    return 1;
+  }
+  TRY(!ichan); // staging assumes the planes start at the first color
+  if(!self->stage)
+  { TRY(self->stage=avcodec_alloc_frame());
+    AVTRY(av_image_alloc(self->stage->data,self->stage->linesize,self->cw,self->h,fmt,FRAME_ALIGN),"Failed to allocate frame.");
+  }
+  convert_region(self,self->sws,self->raw,CCTX(self)->pix_fmt,self->stage,planes,lines);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Arguments for decode_channels(). */
+typedef struct _chan_job_t
+{ ndio_t   file;
+  nd_t     plane;
+  int64_t  iframe;
+  int64_t  ichan;    ///< The channel at plane's first color
+  int      k0,step;  ///< Decode channels k0, k0+step, ...
+} chan_job_t;
+
+/** Converts decoded tile \a k and copies the part of it inside the region into \a plane. */
+static void crop_tile(ndio_ffmpeg_t self, int k, nd_t plane)
+{ const AVFrame *f=self->ch_raw[k],*s=self->ch_stage[k];
+  const size_t lst=ndstrides(plane)[1],
+               bpp=ndstrides(plane)[0];
+  int x,y,w,h,x0,y0,x1,y1,j;
+  tile_rect(self,self->ch[k],&x,&y,&w,&h);
+  sws_scale(self->ch_sws[k],(const uint8_t*const*)f->data,f->linesize,0,h,s->data,s->linesize);
+  x0=(x>self->rx)?x:self->rx;
+  y0=(y>self->ry)?y:self->ry;
+  x1=(x+w<self->rx+self->w)?(x+w):(self->rx+self->w);
+  y1=(y+h<self->ry+self->h)?(y+h):(self->ry+self->h);
+  for(j=y0;j<y1;++j)
+    memcpy((uint8_t*)nddata(plane)+lst*(j-self->ry)+bpp*(x0-self->rx),
+           s->data[0]+s->linesize[0]*(j-y)+bpp*(x0-x),
+           bpp*(x1-x0));
+}
+
+/** Decodes a subset of the channel streams to frame \a iframe and converts
+    the requested channels into the plane.  Runs as a thread.
+    Every stream is decoded, requested or not, so the decoders stay in step.
+ */
+static unsigned decode_channels(void *arg)
+{ chan_job_t *job=(chan_job_t*)arg;
+  ndio_t file=job->file;
+  ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  nd_t plane=job->plane;
+  const int lst=(int)ndstrides(plane)[1];
+  const size_t cst=ndndim(plane)>3?ndstrides(plane)[3]:0;
+  const int64_t n=ndndim(plane)>3?(int64_t)ndshape(plane)[3]:1;
+  int k;
+  for(k=job->k0;k<self->nch;k+=job->step)
+  { TRY(decode_to(file,self->ch[k],self->ch_raw[k],job->iframe));
+    if(self->tcols)
+      crop_tile(self,k,plane);
+    else if(job->ichan<=k && k<job->ichan+n)
+    { uint8_t *planes[4]={(uint8_t*)nddata(plane)+cst*(size_t)(k-job->ichan)};
+      int lines[4]={lst};
+      convert_region(self,self->ch_sws[k],self->ch_raw[k],self->fmt->streams[self->ch[k]]->codec->pix_fmt,
+                     self->ch_stage?self->ch_stage[k]:NULL,planes,lines);
+    }
+  }
+  return 1;
+Error:
+  return 0;
+}
+
+/** Decodes frame \a iframe of every channel stream, spreading the streams over the processors. */
+static int next_channels(ndio_t file, nd_t plane, int64_t iframe, int64_t ichan)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  chan_job_t jobs[64];
+  thread_t threads[64]={0};
+  int i,nw=thread_ncpu(),isok=1;
+  if(nw>self->nch)       nw=self->nch;
+  if(nw>countof(jobs))   nw=countof(jobs);
+  for(i=0;i<nw;++i)
+  { chan_job_t job={file,plane,iframe,ichan,i,nw};
+    jobs[i]=job;
+  }
+  if(nw==1)
+    return decode_channels(jobs);
+  for(i=0;i<nw;++i)
+    TRY(threads[i]=thread_start(decode_channels,jobs+i));
+Finalize:
+  for(i=0;i<nw;++i)
+    if(threads[i])
+      isok&=thread_join(threads[i]);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+static int next(ndio_t file,nd_t plane,int64_t iframe, int64_t ichan);
+
+/** Reads a plane into the f32 array \a plane: decodes to u16 as usual, into
+    a scratch plane, then scales each row into place.  The scratch is one
+    plane, so it stays in cache and the caller never needs a u16 copy of the
+    volume.
+ */
+static int next_f32(ndio_t file, nd_t plane, int64_t iframe, int64_t ichan)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const size_t *st=ndstrides(plane);
+  const int ndim=(ndndim(plane)>4)?4:(int)ndndim(plane);
+  size_t shape[4]={1,1,1,1};
+  int y,c,nc;
+  memcpy(shape,ndshape(plane),sizeof(*shape)*ndim);
+  shape[2]=1;          // plane points at its frame in the caller's volume
+  nc=(int)shape[3];    // color is dimension 3, when there is one
+  TRY(st[0]==sizeof(float));
+  if(!self->u16 || ndndim(self->u16)!=(unsigned)ndim || memcmp(ndshape(self->u16),shape,sizeof(*shape)*ndim))
+  { nd_t t=ndinit();
+    ndfree(self->u16);
+    self->u16=ndheap(ndcast(ndreshape(t,ndim,shape),nd_u16));
+    ndfree(t);
+    TRY(self->u16);
+  }
+  TRY(next(file,self->u16,iframe,ichan));
+  { const size_t *ust=ndstrides(self->u16);
+    const float scale =(iframe<self->nnorm)?self->norm[2*iframe]  :self->scale,
+                offset=(iframe<self->nnorm)?self->norm[2*iframe+1]:self->offset;
+    for(c=0;c<nc;++c)
+      for(y=0;y<self->h;++y)
+        kern_u16_f32((float*)((uint8_t*)nddata(plane)+st[1]*y+(ndim>3?st[3]*c:0)),
+                     (const uint16_t*)((uint8_t*)nddata(self->u16)+ust[1]*y+(ndim>3?ust[3]*c:0)),
+                     self->w,scale,offset);
+  }
+  return 1;
+Error:
+  return 0;
+}
+
+/** Parse next packet from current video.
+    Advances to the next frame.
+
+    Caller is responsible for passing the correct, pre-allocated plane.
+
+    \returns 1 on success, 0 otherwise.
+ */
+static int next(ndio_t file,nd_t plane,int64_t iframe, int64_t ichan)
+{ ndio_ffmpeg_t self;
+  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
+  if(ndtype(plane)==nd_f32)
+    return next_f32(file,plane,iframe,ichan);
+  if(self->nch>1 || self->tcols)
+  { TRY(next_channels(file,plane,iframe,ichan));
+    self->iframe=iframe;
+    return 1;
+  }
+  TRY(decode_to(file,self->istream,self->raw,iframe));
+  if(self->lo>=0)
+    TRY(decode_to(file,self->lo,self->lo_raw,iframe));
   self->iframe=iframe;
 
+  if(self->lo>=0)
+    return unsplit(file,plane);
+  if(self->inv)
+    return unwindow(file,plane);
+
   /*  === Copy out data, translating to desired pixel format ===
       Assume colors are last dimension.
       Assume plane points to start of image for first color.
@@ -634,18 +2762,9 @@ static int next(ndio_t file,nd_t plane,int64_t iframe, int64_t ichan)
     { lines[i+ichan]=lst;
       planes[i+ichan]=(uint8_t*)nddata(plane)+cst*i;
     }
-    sws_scale(self->sws,              // sws context
-              (const uint8_t*const*)self->raw->data, // src slice
-              self->raw->linesize,    // src stride
-              0, // src slice origin y
-              CCTX(self)->height,     // src slice height
-              planes,                 // dst
-              lines);                 // dst line stride
+    return convert(file,planes,lines,(int)ichan);
   }
-  av_free_packet(&packet); // For rawvideo, the packet.data is referenced by raw->data, so free here.
-  return 1;
 Error:
-  av_free_packet( &packet );
   return 0;
 }
 
@@ -655,18 +2774,21 @@ static int seek(ndio_t file, int64_t iframe)
   int64_t duration,ts;
   TRY(self=(ndio_ffmpeg_t)ndioContext(file));
   duration = DURATION(self);
-  ts = iframe; //av_rescale(duration,iframe,self->nframes);
+  ts = frame_to_ts(self,self->istream,iframe);
 
-  TRY(iframe>=0 && iframe<self->nframes);
+  if(self->scout && iframe>=self->nframes)
+    wait_for(self,iframe);
+  TRY(iframe>=0 && iframe<frames(self));
+  TRY(rebalance(self));
   // AVSEEK_FLAG_BACKWARD determines the direction to go from the sought timestamp
   // to find a keyframe.
   //AVTRY(
   avformat_seek_file( self->fmt,       //format context
                             self->istream,   //stream id
-                            0,ts,ts,          //min,target,max timestamps
-                            AVSEEK_FLAG_BACKWARD|AVSEEK_FLAG_FRAME);//,//flags
+                            INT64_MIN,ts,ts,  //min,target,max timestamps
+                            AVSEEK_FLAG_BACKWARD);//,//flags
                             //"Failed to seek.");
-//(necessary?)  avcodec_flush_buffers(CCTX(self));
+  reset_queues(self);
   return 1;
 Error:
   return 0;
@@ -676,11 +2798,504 @@ Error:
 static int64_t nframes(const ndio_t file)
 { ndio_ffmpeg_t self;
   TRY(self=(ndio_ffmpeg_t)ndioContext(file));
-  return self->nframes;
+  return frames(self);
+Error:
+  return 0;
+}
+
+/** Finds the first frame of each independently decodable chunk, for files
+    written with the chunk parameter.
+    \returns the number of chunks, with their first frames in \a starts (caller frees),
+             or 0 if the file isn't chunked.
+ */
+static int chunk_starts(ndio_t file, int64_t n, int64_t **starts)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const char *v=meta_get(self,"chunk");
+  int k,c=0;
+  *starts=0;
+  if(!v || n<=0)
+    return 0;
+  if((k=atoi(v))>0)
+  { int64_t i;
+    TRY(*starts=(int64_t*)malloc(sizeof(int64_t)*(size_t)((n+k-1)/k)));
+    for(i=0;i<n;i+=k)
+      (*starts)[c++]=i;
+    return c;
+  }
+  if(!strncmp(v,"write:",6)) // the writer listed the first frame of each write
+  { const char *p;
+    char *e;
+    int64_t i;
+    for(p=v+6,k=1;*p;++p)
+      k+=(*p==',');
+    TRY(*starts=(int64_t*)malloc(sizeof(int64_t)*k));
+    for(p=v+6;*p;p=(*e==',')?e+1:e)
+    { i=strtol(p,&e,10);
+      if(e==p)
+        break;
+      if(i<n && (c==0 || i>(*starts)[c-1]))
+        (*starts)[c++]=i;
+    }
+    return c;
+  }
+  // Chunks started at every write, but the container kept only the header's tags
+  // (e.g. mkv, nut).  Those keyframes close their GOPs, so every keyframe starts a chunk.
+  { AVPacket p={0};
+    int64_t i=0,*t;
+    int cap=64,oom=0;
+    TRY(*starts=(int64_t*)malloc(sizeof(int64_t)*cap));
+    av_init_packet(&p);
+    while(i<n && av_read_frame(self->fmt,&p)>=0)
+    { if(p.stream_index==self->istream)
+      { if(p.flags&AV_PKT_FLAG_KEY)
+        { if(c==cap)
+          { if(!(t=(int64_t*)realloc(*starts,sizeof(int64_t)*(cap*=2))))
+            { oom=1;
+              av_free_packet(&p);
+              break;
+            }
+            *starts=t;
+          }
+          (*starts)[c++]=i;
+        }
+        ++i;
+      }
+      av_free_packet(&p);
+    }
+    av_seek_frame(self->fmt,self->istream,0,AVSEEK_FLAG_BACKWARD);
+    reset_queues(self);
+    TRY(!oom);
+  }
+  return c;
+Error:
+  SAFEFREE(*starts);
+  return 0;
+}
+
+/** Arguments for read_chunk(). */
+typedef struct _chunk_job_t
+{ const char *path;
+  nd_t        dst;  ///< View of the planes to read
+  size_t      i0;   ///< Index of the first plane
+  int64_t     n;    ///< Frames in the file, so the reader needn't count them again
+} chunk_job_t;
+
+/** Reads a run of chunks through a reader of its own.  Runs as a thread. */
+static unsigned read_chunk(void *arg)
+{ chunk_job_t *job=(chunk_job_t*)arg;
+  size_t pos[8]={0}; // the frame index is dimension 2 (see seek_ffmpeg())
+  ndio_t f;
+  unsigned ok=0;
+  pos[2]=job->i0;
+  if((f=ndioOpen(job->path,name_ffmpeg(),"r")))
+  { ndio_ffmpeg_t r=(ndio_ffmpeg_t)ndioContext(f);
+    if(r->nframes<0)
+      r->nframes=job->n;
+    ok=(ndioReadSubarray(f,job->dst,pos,NULL)!=NULL);
+  }
+  ndioClose(f);
+  return ok;
+}
+
+/** Reads every frame of a chunked file by decoding runs of chunks in parallel.
+    Each thread opens its own reader and seeks straight to its first chunk.
+    \returns 1 on success, 0 on failure, or -1 if the file or array doesn't allow it.
+ */
+static int read_chunks(ndio_t file, nd_t a, int64_t n)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  int64_t     *starts=0;
+  chunk_job_t *jobs=0;
+  thread_t    *threads=0;
+  int i,nc,nw=thread_ncpu(),isok=1;
+  if(ndndim(a)!=3 || self->scout) // color planes aren't contiguous, and growing files have no fixed chunks
+    return -1;
+  if((nc=chunk_starts(file,n,&starts))<2 || nw<2)
+  { SAFEFREE(starts);
+    return -1;
+  }
+  if(nw>nc) nw=nc;
+  NEW(chunk_job_t,jobs,nw);
+  NEW(thread_t,threads,nw);
+  memset(jobs,0,sizeof(chunk_job_t)*nw);
+  memset(threads,0,sizeof(thread_t)*nw);
+  for(i=0;i<nw;++i)
+  { int c0=(int)(((int64_t)nc*i)/nw),
+        c1=(int)(((int64_t)nc*(i+1))/nw);
+    size_t shape[3];
+    int64_t i1=(c1<nc)?starts[c1]:n;
+    memcpy(shape,ndshape(a),sizeof(shape));
+    shape[2]=(size_t)(i1-starts[c0]);
+    jobs[i].path=self->path;
+    jobs[i].i0  =(size_t)starts[c0];
+    jobs[i].n   =n;
+    TRY(jobs[i].dst=ndcast(ndreshape(ndinit(),3,shape),ndtype(a)));
+    TRY(ndref(jobs[i].dst,(uint8_t*)nddata(a)+ndstrides(a)[2]*jobs[i].i0,nd_static));
+    TRY(threads[i]=thread_start(read_chunk,jobs+i));
+  }
+Finalize:
+  if(threads)
+    for(i=0;i<nw;++i)
+      if(threads[i])
+        isok&=thread_join(threads[i]);
+  if(jobs)
+    for(i=0;i<nw;++i)
+      ndfree(jobs[i].dst);
+  SAFEFREE(threads);
+  SAFEFREE(jobs);
+  SAFEFREE(starts);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+/** Reads the w,h,d volume in \a file (for 5D files, just part 0) into \a a. */
+static unsigned read_volume(ndio_t file, nd_t a)
+{ int64_t i,n=nframes(file); // in follow mode the count may grow while reading, but the array won't
+  void *o=nddata(a);
+  switch(read_chunks(file,a,n))
+  { case 1: return 1;
+    case 0: goto Error;
+    default:; // read serially
+  }
+  TRY(seek(file,0));
+  for(i=0;i<n;++i,ndoffset(a,2,1))
+    TRY(next(file,a,i,0));
+  ndref(a,o,ndkind(a));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Folds plane \a z, decoded into \a a, into the reductions in \a r.
+    \a hist is a scratch 65536-bin histogram, zero on entry and on return, or NULL.
+    \returns 0 if the caller's callback asked to stop, otherwise 1.
+*/
+static int reduce_plane(ndio_ffmpeg_reduce_t *r, nd_t a, int64_t z, uint32_t *hist)
+{ const int w=(int)ndshape(a)[0],h=(int)ndshape(a)[1];
+  const size_t ls=ndstrides(a)[1];
+  const int stats=r->plane_mean||r->plane_min||r->plane_max;
+  uint16_t mn=0xffff,mx=0;
+  uint64_t sum=0;
+  int i,y;
+  for(y=0;y<h;++y)
+  { const uint16_t *row=(const uint16_t*)((uint8_t*)nddata(a)+ls*y);
+    if(r->max) kern_u16_max(r->max+(size_t)w*y,row,w);
+    if(r->min) kern_u16_min(r->min+(size_t)w*y,row,w);
+    if(r->sum) kern_u16_sum(r->sum+(size_t)w*y,row,w);
+    if(stats)  kern_u16_stats(row,w,&mn,&mx,&sum);
+    if(hist)   kern_u16_hist(hist,row,w);
+  }
+  if(r->plane_mean) r->plane_mean[z]=sum/((double)w*h);
+  if(r->plane_min)  r->plane_min[z]=mn;
+  if(r->plane_max)  r->plane_max[z]=mx;
+  if(hist)
+    for(i=0;i<65536;++i)
+    { r->hist[i]+=hist[i];
+      hist[i]=0;
+    }
+  ++r->nplanes;
+  return r->fn?r->fn(r->ctx,(const uint16_t*)nddata(a),w,h,ls,z):1;
+}
+
+/** Decodes every plane of \a file into the one-plane array \a a, in turn,
+    reducing each as it arrives (see \ref ndio-ffmpeg-reduce).
+*/
+static unsigned reduce_volume(ndio_t file, nd_t a, ndio_ffmpeg_reduce_t *r)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const size_t npx=(size_t)self->w*self->h;
+  uint32_t *hist=0;
+  int64_t i,n=nframes(file);
+  size_t j;
+  if(self->parts)
+    FAIL("Reductions read one w,h,d volume.  Open the part files of 5D arrays one at a time.");
+  if(self->nch>1 && !self->tcols)
+    FAIL("Reductions need single channel files.");
+  TRY(ndtype(a)==nd_u16);
+  TRY(ndshape(a)[0]==(size_t)self->w && ndshape(a)[1]==(size_t)self->h && ndnelem(a)==npx);
+  if(r->max) memset(r->max,0,npx*sizeof(*r->max));
+  if(r->min) for(j=0;j<npx;++j) r->min[j]=0xffff;
+  if(r->sum) memset(r->sum,0,npx*sizeof(*r->sum));
+  if(r->hist)
+  { memset(r->hist,0,65536*sizeof(*r->hist));
+    NEW(uint32_t,hist,65536);
+    memset(hist,0,65536*sizeof(*hist));
+  }
+  r->nplanes=0;
+  TRY(seek(file,0));
+  for(i=0;i<n;++i)
+  { TRY(next(file,a,i,0));
+    if(!reduce_plane(r,a,i,hist))
+      break;
+  }
+  SAFEFREE(hist);
+  return 1;
+Error:
+  SAFEFREE(hist);
+  return 0;
+}
+
+/** A plane buffer in the ring of a pipelined read or write (see stream_volume() and source_volume()). */
+typedef struct _slot_t
+{ nd_t    a;     ///< The plane
+  int64_t z;     ///< The plane held in \a a, or -1 if the slot is free.
+  int     ready; ///< Writes: nonzero once the caller's callback has filled the plane.
+} slot_t;
+
+/** State shared by the decoder (or encoder) and the workers of a pipelined
+    read (or write).  Plane z goes in slot z%n, and workers take planes in
+    order, so the other side only ever waits for the slot it needs next.
+*/
+typedef struct _pipe_t
+{ ndio_ffmpeg_stream_t *s;
+  slot_t  *slots;
+  int      n;    ///< Number of slots
+  int64_t  take; ///< The next plane a worker will take
+  int64_t  end;  ///< Reads: planes decoded so far.  Writes: the planes to write.
+  int      done; ///< Nonzero once the decoder has stopped
+  int      stop; ///< Nonzero once a callback asked to stop, or the read or write failed
+  mutex_t  lock; ///< Guards everything above except the planes
+  cond_t   cv;   ///< Signalled whenever a slot is filled or freed, or the read ends
+} pipe_t;
+
+/** Hands decoded planes to the caller's callback until the decoder is done
+    and the ring is drained, or the read is stopped.  Runs as a thread.
+*/
+static unsigned stream_worker(void *arg)
+{ pipe_t *p=(pipe_t*)arg;
+  mutex_lock(p->lock);
+  for(;;)
+  { slot_t *slot;
+    int64_t z;
+    int ok;
+    while(!p->stop && !p->done && p->take>=p->end)
+      cond_wait(p->cv,p->lock);
+    if(p->stop || p->take>=p->end)
+      break;
+    z=p->take++;
+    slot=p->slots+z%p->n;
+    mutex_unlock(p->lock);
+    ok=p->s->fn(p->s->ctx,slot->a,z);
+    mutex_lock(p->lock);
+    slot->z=-1;
+    ++p->s->nplanes;
+    if(!ok)
+      p->stop=1;
+    cond_broadcast(p->cv);
+  }
+  mutex_unlock(p->lock);
+  return 1;
+}
+
+/** Decodes frame \a iframe and hands it to the caller's native-format
+    callback (see ndio_ffmpeg_stream_t::native).  Seeks unless \a iframe
+    follows the last frame decoded.  Nothing is converted or copied, so the
+    callback runs on this thread before the decoder reuses the frame.
+    \param[out] more Set to the callback's result: 0 asks to stop.
+*/
+static int native_frame(ndio_t file, int64_t iframe, ndio_ffmpeg_stream_t *s, int *more)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  ndio_ffmpeg_frame_t f;
+  if(self->parts || self->tcols || self->nch>1 || self->lo>=0)
+    FAIL("Native frames are only available from files holding a single video stream.");
+  if(iframe!=self->iframe+1)
+    TRY(seek(file,iframe));
+  TRY(decode_to(file,self->istream,self->raw,iframe));
+  self->iframe=iframe;
+  f.pixfmt=CCTX(self)->pix_fmt;
+  crop_planes(self->raw,f.pixfmt,self->rx,self->ry,f.data);
+  memcpy(f.linesize,self->raw->linesize,sizeof(f.linesize));
+  f.w=self->w;
+  f.h=self->h;
+  ++s->nplanes;
+  *more=s->native(s->ctx,&f,iframe);
+  return 1;
+Error:
+  return 0;
+}
+
+/** Hands every frame of \a file to the caller's native-format callback as
+    it is decoded (see native_frame()).
+*/
+static unsigned native_volume(ndio_t file, ndio_ffmpeg_stream_t *s)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  int64_t i,n=nframes(file);
+  int more=1;
+  s->nplanes=0;
+  TRY(seek(file,0));
+  self->iframe=-1;
+  for(i=0;i<n && more;++i)
+    TRY(native_frame(file,i,s,&more));
+  return 1;
+Error:
+  return 0;
+}
+
+/** Decodes every plane of \a file into a ring of buffers shaped like \a a,
+    while worker threads hand them to the caller's callback (see
+    \ref ndio-ffmpeg-reduce).  \a a itself is not written, and is ignored
+    for native-format reads.
+*/
+static unsigned stream_volume(ndio_t file, nd_t a, ndio_ffmpeg_stream_t *s)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  pipe_t p;
+  thread_t *threads=0;
+  int64_t i,n=nframes(file);
+  int k,nw=(s->workers>1)?s->workers:1,isok=1;
+  memset(&p,0,sizeof(p));
+  if(s->native)
+    return native_volume(file,s);
+  if(self->parts)
+    FAIL("Streamed reads cover one w,h,d volume.  Open the part files of 5D arrays one at a time.");
+  TRY(s->fn);
+  TRY(ndtype(a)==nd_u16 || ndtype(a)==nd_f32);
+  TRY(ndshape(a)[0]==(size_t)self->w && ndshape(a)[1]==(size_t)self->h && (ndndim(a)<3 || ndshape(a)[2]==1));
+  p.s=s;
+  p.n=(s->depth>0)?s->depth:2*nw;
+  NEW(slot_t,p.slots,p.n);
+  memset(p.slots,0,sizeof(slot_t)*p.n);
+  for(k=0;k<p.n;++k)
+  { TRY(p.slots[k].a=ndheap(a));
+    p.slots[k].z=-1;
+  }
+  TRY(p.lock=mutex_alloc());
+  TRY(p.cv=cond_alloc());
+  s->nplanes=0;
+  TRY(seek(file,0));
+  NEW(thread_t,threads,nw);
+  memset(threads,0,sizeof(thread_t)*nw);
+  for(k=0;k<nw;++k)
+    TRY(threads[k]=thread_start(stream_worker,&p));
+  for(i=0;i<n;++i)
+  { slot_t *slot=p.slots+i%p.n;
+    int stop;
+    mutex_lock(p.lock);
+    while(!p.stop && slot->z>=0)
+      cond_wait(p.cv,p.lock);
+    stop=p.stop;
+    mutex_unlock(p.lock);
+    if(stop)
+      break;
+    TRY(next(file,slot->a,i,0));
+    mutex_lock(p.lock);
+    slot->z=i;
+    p.end=i+1;
+    cond_broadcast(p.cv);
+    mutex_unlock(p.lock);
+  }
+Finalize:
+  if(p.lock && p.cv)
+  { mutex_lock(p.lock);
+    p.done=1;
+    if(!isok) p.stop=1;
+    cond_broadcast(p.cv);
+    mutex_unlock(p.lock);
+  }
+  if(threads)
+    for(k=0;k<nw;++k)
+      if(threads[k])
+        isok&=thread_join(threads[k]);
+  SAFEFREE(threads);
+  if(p.slots)
+    for(k=0;k<p.n;++k)
+      ndfree(p.slots[k].a);
+  SAFEFREE(p.slots);
+  cond_free(p.cv);
+  mutex_free(p.lock);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+/** Arguments for part_job(). */
+typedef struct _part_job_t
+{ ndio_t  file;  ///< The 5D file
+  nd_t    a;     ///< The whole w,h,d,c,t array
+  int     t0;    ///< The file's time point for t=0 of \a a
+  int     k0,step; ///< Handle parts k0, k0+step, ... of \a a
+  int     write; ///< Nonzero to write the parts, otherwise read them
+} part_job_t;
+
+/** Points \a v at the w,h,d volume for part \a k of the 5D array \a a. */
+static nd_t part_view(nd_t v, nd_t a, int k, int pc)
+{ const size_t *s=ndshape(a),*st=ndstrides(a);
+  size_t shape[3];
+  memcpy(shape,s,sizeof(shape));
+  if(!ndcast(ndreshape(v,3,shape),ndtype(a)))
+    return 0;
+  return ndref(v,(uint8_t*)nddata(a)+st[3]*(k%pc)+st[4]*(k/pc),nd_static);
+}
+
+static unsigned write_volume(ndio_t file, nd_t a);
+
+/** Reads or writes a subset of the parts of a 5D array.  Runs as a thread.
+    Parts other than 0 are opened here and closed when done, so jobs don't
+    share codecs, and a write has only the running jobs' encoders open.
+ */
+static unsigned part_job(void *arg)
+{ part_job_t *job=(part_job_t*)arg;
+  ndio_t file=job->file;
+  ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  nd_t v=0;
+  int k,n=self->pc*(int)ndshape(job->a)[4];
+  TRY(v=ndinit());
+  for(k=job->k0;k<n;k+=job->step)
+  { int p=k+self->pc*job->t0; // the part's index in the file
+    TRY(part_view(v,job->a,k,self->pc));
+    if(p==0)
+      TRY(job->write?write_volume(file,v):read_volume(file,v));
+    else
+    { char *path=part_path(self->path,p%self->pc,p/self->pc);
+      ndio_t f=path?ndioOpen(path,name_ffmpeg(),job->write?"w":"r"):0;
+      unsigned ok=f && (job->write?write_volume(f,v):read_volume(f,v));
+      if(!f) LOG("ndio-ffmpeg: Could not open part %s."ENDL,path?path:"(out of memory)");
+      ndioClose(f);
+      SAFEFREE(path);
+      TRY(ok);
+    }
+  }
+  ndfree(v);
+  return 1;
 Error:
+  ndfree(v);
   return 0;
 }
 
+/** Reads or writes every part of the 5D array \a a, whose first time point is
+    the file's time point \a t0, spreading the parts over the processors.
+ */
+static int run_parts(ndio_t file, nd_t a, int t0, int write)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  part_job_t *jobs=0;
+  thread_t   *threads=0;
+  int i,n=self->pc*(int)ndshape(a)[4],nw=thread_ncpu(),isok=1;
+  if(nw>n) nw=n;
+  NEW(part_job_t,jobs,nw);
+  NEW(thread_t,threads,nw);
+  memset(threads,0,sizeof(thread_t)*nw);
+  for(i=0;i<nw;++i)
+  { part_job_t job={file,a,t0,i,nw,write};
+    jobs[i]=job;
+  }
+  if(nw==1)
+    isok=part_job(jobs);
+  else
+    for(i=0;i<nw;++i)
+      TRY(threads[i]=thread_start(part_job,jobs+i));
+Finalize:
+  if(threads)
+    for(i=0;i<nw;++i)
+      if(threads[i])
+        isok&=thread_join(threads[i]);
+  SAFEFREE(threads);
+  SAFEFREE(jobs);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
 /**
   Reads the data in \a file into the array \a a.
   The caller must allocate \a a, make sure it has the correct shape,
@@ -691,13 +3306,18 @@ Error:
     2. Array container has the correct size and type
 */
 static unsigned read_ffmpeg(ndio_t file, nd_t a)
-{ int64_t i;
-  void *o=nddata(a);
-  TRY(seek(file,0));
-  for(i=0;i<nframes(file);++i,ndoffset(a,2,1))
-    TRY(next(file,a,i,0));
-  ndref(a,o,ndkind(a));
-  return 1;
+{ ndio_ffmpeg_t self;
+  ndio_ffmpeg_params_t *params;
+  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
+  if((params=(ndio_ffmpeg_params_t*)ndioGet(file)) && params->stream)
+    return stream_volume(file,a,params->stream);
+  if(params && params->reduce)
+    return reduce_volume(file,a,params->reduce);
+  if(self->parts)
+  { TRY(ndndim(a)==5 && ndshape(a)[3]==(size_t)self->pc && ndshape(a)[4]==(size_t)self->pt);
+    return run_parts(file,a,0,0);
+  }
+  return read_volume(file,a);
 Error:
   return 0;
 }
@@ -708,17 +3328,23 @@ Error:
  * Only d is seekable.
  */
 static unsigned canseek_ffmpeg(ndio_t file, size_t idim)
-{return idim==2;}
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  if(self && self->parts) // 5D: c and t pick a part
+    return 2<=idim && idim<=4;
+  return idim==2;
+}
 
-/**
- * Seek
- * pos should be an array with ndndim(ndioShape(file)) elements.
- */
-static unsigned seek_ffmpeg(ndio_t file,nd_t a,size_t *pos)
+/** Reads plane \a pos[2] of the volume in \a file into \a a. */
+static unsigned seek_plane(ndio_t file,nd_t a,size_t *pos)
 { ndio_ffmpeg_t self;
+  ndio_ffmpeg_params_t *params;
   size_t i=pos[2];           // WARNING: assumes shape_ffmpeg always returns at least a 3 dimensional shape even when width and nchan is 1.
   TRY(self=(ndio_ffmpeg_t)ndioContext(file));
   TRY(ndndim(a)>=2);
+  if((params=(ndio_ffmpeg_params_t*)ndioGet(file)) && params->stream && params->stream->native)
+  { int more; // one frame: whether the callback wants more doesn't matter
+    return native_frame(file,(int64_t)i,params->stream,&more);
+  }
   //i=(ndndim(a)>2)?pos[2]:0;
   if(i!=self->iframe+1)
     TRY(seek(file,i));
@@ -728,6 +3354,38 @@ Error:
   return 0;
 }
 
+/**
+ * Seek
+ * pos should be an array with ndndim(ndioShape(file)) elements.
+ * For 5D files, only the part holding pos[3],pos[4] is decoded.
+ */
+static unsigned seek_ffmpeg(ndio_t file,nd_t a,size_t *pos)
+{ ndio_ffmpeg_t self;
+  size_t q[5]={0};
+  int k;
+  TRY(self=(ndio_ffmpeg_t)ndioContext(file));
+  if(!self->parts)
+    return seek_plane(file,a,pos);
+  TRY(pos[3]<(size_t)self->pc && pos[4]<(size_t)self->pt);
+  q[2]=pos[2];
+  if(!(k=(int)(pos[3]+self->pc*pos[4])))
+    return seek_plane(file,a,q);
+  if(self->ipart!=k)
+  { char *path;
+    ndioClose(self->parts[self->ipart]); // parts[0] is always NULL
+    self->parts[self->ipart]=0;
+    self->ipart=0;
+    TRY(path=part_path(self->path,(int)pos[3],(int)pos[4]));
+    self->parts[k]=ndioOpen(path,name_ffmpeg(),"r");
+    free(path);
+    TRY(self->parts[k]);
+    self->ipart=k;
+  }
+  return seek_plane(self->parts[k],a,q);
+Error:
+  return 0;
+}
+
 static void argmin_sz(size_t n, const size_t *v, size_t *argmin, size_t *min)
 { size_t i,am=0,m=v[0];
   for(i=1;i<n;++i) if(v[i]<m) m=v[am=i];
@@ -735,6 +3393,325 @@ static void argmin_sz(size_t n, const size_t *v, size_t *argmin, size_t *min)
   if(min)    *min=m;
 }
 
+/** Copies plane \a i of \a src into the encoder's input frame. */
+static void fill_frame(enc_t *enc, const src_t *src, int i, uint16_t *q)
+{ const uint8_t* plane=src->data+src->planestride*i+src->colorstride*enc->channel
+                      +src->linestride*enc->y0+src->pixelstride*enc->x0;
+  AVFrame *f=enc->raw;
+  int y,linestride=src->linestride;
+  if(q) // float or wide samples: quantize the rows this encoder reads, then pack those
+  { const double lo=src->qplanes?src->qplanes[2*i]  :src->qlo,
+                 k =src->qplanes?src->qplanes[2*i+1]:src->qk;
+    for(y=0;y<enc->src_h;++y)
+      quantize_row(src->type,q+(size_t)enc->src_w*y,plane+src->linestride*y,enc->src_w,lo,k);
+    plane=(const uint8_t*)q;
+    linestride=enc->src_w*(int)sizeof(*q);
+  }
+  if(enc->sws)
+  { const uint8_t* slice[4]={ plane+src->colorstride*0,
+                              plane+src->colorstride*1,
+                              plane+src->colorstride*2,
+                              plane+src->colorstride*3};
+    const int stride[4]={linestride,linestride,linestride,linestride};
+    sws_scale(enc->sws,slice,stride,0,enc->src_h,f->data,f->linesize);
+  } else
+  { for(y=0;y<enc->src_h;++y)
+    { const uint16_t *s=(const uint16_t*)(plane+linestride*y);
+      uint8_t *d=f->data[0]+f->linesize[0]*y;
+      switch(enc->role)
+      { case ENC_HI: kern_u16_hi(d,s,enc->src_w); break;
+        case ENC_LO: kern_u16_lo(d,s,enc->src_w); break;
+        default:
+          if(enc->lut) kern_u16_lut(d,s,enc->src_w,enc->lut);
+          else         kern_u16_window(d,s,enc->src_w,enc->win_lo,enc->win_scale);
+      }
+    }
+  }
+  pad_frame(f,enc->cctx->pix_fmt,enc->src_w,enc->src_h,enc->width,enc->height);
+}
+
+/** Arguments for encode_planes(). */
+typedef struct _job_t
+{ ndio_t        file;
+  enc_t        *enc;
+  const src_t  *src;
+  int           i0,i1;      ///< Encode planes [i0,i1)
+  int           nthreads;   ///< Threads for a private segment encoder.  0 encodes directly with \a enc.
+  AVPacketList *head,*tail; ///< Packets from a segment encoder, in coding order.  Muxed after every segment is done.
+} job_t;
+
+/** Encodes a packet with a segment encoder and keeps it on the job's list. */
+static int keep(job_t *job, enc_t *seg, AVFrame *frame, int *got_packet)
+{ ndio_t file=job->file;
+  AVPacketList *e=0;
+  NEW(AVPacketList,e,1);
+  memset(e,0,sizeof(*e));
+  av_init_packet(&e->pkt);
+  AVTRY(avcodec_encode_video2(seg->cctx,&e->pkt,frame,got_packet), frame?"Failed to encode frame.":"Failed to encode terminating frame.");
+  if(!*got_packet)
+  { free(e);
+    return 1;
+  }
+  AVTRY(av_dup_packet(&e->pkt),"Failed to hold packet.");
+  if(job->tail) job->tail->next=e;
+  else          job->head=e;
+  job->tail=e;
+  return 1;
+Error:
+  if(e)
+  { av_free_packet(&e->pkt);
+    free(e);
+  }
+  return 0;
+}
+
+/** Releases any packets left on a job's list. */
+static void drop_packets(job_t *job)
+{ AVPacketList *e,*n;
+  for(e=job->head;e;e=n)
+  { n=e->next;
+    av_free_packet(&e->pkt);
+    free(e);
+  }
+  job->head=job->tail=0;
+}
+
+/** \returns the picture type that puts a frame on a chunk boundary, if it's
+    the first of a chunk, otherwise AV_PICTURE_TYPE_NONE (the encoder decides).
+    \param[in] pts   The frame's timestamp, counted in frames from the start of the stream.
+    \param[in] i     The frame's plane index within the current write.
+ */
+static int chunk_picture_type(ndio_ffmpeg_t self, int64_t pts, int i)
+{ if(self->chunk>0 && pts%self->chunk==0) return AV_PICTURE_TYPE_I;
+  if(self->chunk<0 && i==0)                return AV_PICTURE_TYPE_I;
+  return AV_PICTURE_TYPE_NONE;
+}
+
+/** Encodes planes [i0,i1) of a source.  Runs as a thread when there are several jobs.
+
+    With \a nthreads set, the planes are encoded as an independent segment by a
+    private encoder, and the packets are held for encode() to mux in order.
+ */
+static unsigned encode_planes(void *arg)
+{ job_t *job=(job_t*)arg;
+  ndio_t file=job->file;
+  ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  enc_t  *enc=job->enc,seg={0};
+  AVPacket p={0};
+  uint16_t *q=0; // one quantized plane, for float and wide samples
+  int i,got_packet;
+  if(quantized(job->src->type))
+    NEW(uint16_t,q,(size_t)job->src->w*job->src->h);
+  if(!job->nthreads)
+  { for(i=job->i0;i<job->i1;++i)
+    { av_init_packet(&p); // FIXME: for efficiency, probably want to preallocate packet
+      fill_frame(enc,job->src,i,q);
+      enc->raw->pict_type=chunk_picture_type(self,enc->pts,i);
+      enc->raw->pts=enc->pts++;
+      TRY(push(file,enc,&p,enc->raw,&got_packet));
+    }
+    SAFEFREE(q);
+    return 1;
+  }
+  TRY(open_segment(&seg,enc,job->nthreads));
+  for(i=job->i0;i<job->i1;++i)
+  { fill_frame(&seg,job->src,i,q);
+    seg.raw->pts=enc->pts+i;
+    seg.raw->pict_type=chunk_picture_type(self,seg.raw->pts,i);
+    TRY(keep(job,&seg,seg.raw,&got_packet));
+  }
+  if(seg.cctx->codec->capabilities & CODEC_CAP_DELAY)
+    do TRY(keep(job,&seg,0,&got_packet)); while(got_packet);
+  close_segment(&seg);
+  SAFEFREE(q);
+  return 1;
+Error:
+  close_segment(&seg);
+  SAFEFREE(q);
+  return 0;
+}
+
+/** Runs every encoder over the source planes.  Each encoder gets its own thread when there are several.
+
+    With \a nseg>1, each encoder's planes are split into \a nseg contiguous
+    segments that are encoded concurrently by private closed-GOP encoders.  The
+    segments' packets are then muxed in order, so the output is one stream
+    just as if the planes were encoded serially.
+ */
+static int encode(ndio_t file, const src_t *src, int nseg, int nthreads)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  job_t    *jobs=0;
+  thread_t *threads=0;
+  int i,s,e,njobs,isok=1;
+  if(self->chunk<0)
+    TRY(meta_note_write(self,self->enc[0].pts));
+  if(nseg>src->d) nseg=src->d;
+  if(nseg<1)      nseg=1;
+  njobs=nseg*self->nenc;
+  if(njobs==1)
+  { job_t job={file,self->enc,src,0,src->d,0,0,0};
+    return encode_planes(&job);
+  }
+  NEW(job_t,jobs,njobs);
+  NEW(thread_t,threads,njobs);
+  memset(jobs,0,sizeof(job_t)*njobs);
+  memset(threads,0,sizeof(thread_t)*njobs);
+  for(s=0,i=0;s<nseg;++s)
+    for(e=0;e<self->nenc;++e,++i)
+    { jobs[i].file    =file;
+      jobs[i].enc     =self->enc+e;
+      jobs[i].src     =src;
+      jobs[i].i0      =(int)(((int64_t)src->d*s)/nseg);
+      jobs[i].i1      =(int)(((int64_t)src->d*(s+1))/nseg);
+      jobs[i].nthreads=(nseg>1)?nthreads:0;
+      TRY(threads[i]=thread_start(encode_planes,jobs+i));
+    }
+Finalize:
+  if(threads)
+    for(i=0;i<njobs;++i)
+      if(threads[i])
+        isok&=thread_join(threads[i]);
+  if(nseg>1 && jobs)
+  { for(i=0;i<njobs;++i)    // segment-major order, so each stream's packets stay in order
+    { AVPacketList *p;
+      while(isok && (p=jobs[i].head))
+      { jobs[i].head=p->next;
+        isok&=mux(self,jobs[i].enc,&p->pkt);
+        free(p);
+      }
+      jobs[i].tail=0;
+      drop_packets(jobs+i);
+    }
+    if(isok)
+      for(e=0;e<self->nenc;++e)
+        self->enc[e].pts+=src->d;
+  }
+  SAFEFREE(threads);
+  SAFEFREE(jobs);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+/** Writes a w,h,d,c,t array as c*t parts (see \ref ndio-ffmpeg-parts).
+    The time points follow those of earlier writes.
+ */
+static unsigned write_parts(ndio_t file, nd_t a)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const size_t *s=ndshape(a);
+  if(!self->pc)
+  { if(self->base || self->nenc)
+      FAIL("5D arrays can only be written to a new file.");
+    TRY(s[3]>0);
+    self->pc=(int)s[3];
+  } else if(s[3]!=(size_t)self->pc || !self->nenc || s[2]!=(size_t)self->enc[0].pts)
+    FAIL("Every write to a 5D file must have the same depth and number of channels.");
+  TRY(s[4]>0);
+  // Set before part 0's header is written.  Containers that write tags at the trailer get the final count.
+  TRY(meta_setf(self,"parts","%d,%d",self->pc,self->pt+(int)s[4]));
+  TRY(run_parts(file,a,self->pt,1));
+  self->pt+=(int)s[4];
+  return 1;
+Error:
+  return 0;
+}
+
+/** Smallest and largest sample in plane \a i of \a src, over \a nc channels.  NaNs are skipped. */
+static void plane_range(const src_t *src, int i, int nc, double *lo, double *hi)
+{ int y,c;
+  for(c=0;c<nc;++c)
+    for(y=0;y<src->h;++y)
+    { const uint8_t *row=src->data+src->planestride*i+src->colorstride*c+src->linestride*y;
+      switch(src->type)
+      { case nd_f32: kern_f32_range((const float*)   row,src->w,lo,hi); break;
+        case nd_f64: kern_f64_range((const double*)  row,src->w,lo,hi); break;
+        case nd_u32: kern_u32_range((const uint32_t*)row,src->w,lo,hi); break;
+        default:     kern_u64_range((const uint64_t*)row,src->w,lo,hi);
+      }
+    }
+}
+
+/** Maps the range [\a lo,\a hi] onto 0..65535: *qk=65535/(hi-lo). */
+static double quant_gain(double lo, double hi)
+{ return (hi>lo)?65535.0/(hi-lo):65535.0;
+}
+
+/** Decides how the float or 32/64-bit samples of \a src are quantized to u16
+    (see ndio_ffmpeg_params_t::quantize).  The first write records the
+    mapping back for readers as norm (or norm_planes) metadata; later writes
+    and appends reuse it.  Per-plane mappings go in src->qplanes, which the
+    caller frees.
+ */
+static int init_quantize(ndio_t file, src_t *src, int chans, const ndio_ffmpeg_params_t *params)
+{ ndio_ffmpeg_t self=(ndio_ffmpeg_t)ndioContext(file);
+  const char *q=params->quantize?params->quantize:"auto";
+  const int nc=chans?src->c:1;
+  char *buf=0;
+  double lo=HUGE_VAL,hi=-HUGE_VAL;
+  int i;
+  if(src->c>1 && !chans)
+    FAIL("Float and 32/64-bit data must be single channel, or written with channel_streams.");
+  if(src->pixelstride!=(size_t)((src->type==nd_f32||src->type==nd_u32)?4:8))
+    FAIL("Float and 32/64-bit data must have contiguous pixels.");
+  if((params->window && !strncmp(params->window,"auto",4)) || (params->anscombe && !params->window))
+    FAIL("An automatic window can't be combined with quantization.  Quantize to the range wanted instead.");
+  src->pixfmt=PIX_FMT_GRAY16;
+  switch(self->qmode)
+  { case 1:
+      src->qlo=self->qlo;
+      src->qk =self->qk;
+      return 1;
+    case 2:
+      FAIL("Per-plane quantization needs the whole volume in one write.");
+    default:;
+  }
+  if(self->nenc)
+    FAIL("Every write must be quantized the same way: this file started with 8 or 16-bit data.");
+  if(self->base) // appending: keep the file's mapping
+  { const char *v=meta_get(self,"norm");
+    float scale,offset;
+    if(!(v && 2==sscanf(v,"%f,%f",&scale,&offset) && scale>0.0f))
+      FAIL("Can't append quantized data to a file that doesn't record a single quantization (norm metadata).");
+    self->qlo=offset;
+    self->qk =1.0/scale;
+  } else if(streq(q,"plane"))
+  { size_t n=0;
+    NEW(double,src->qplanes,2*src->d);
+    NEW(char,buf,40*(size_t)src->d+1);
+    buf[0]='\0';
+    for(i=0;i<src->d;++i)
+    { lo=HUGE_VAL; hi=-HUGE_VAL;
+      plane_range(src,i,nc,&lo,&hi);
+      if(lo>hi) lo=hi=0.0; // all NaN
+      src->qplanes[2*i]  =lo;
+      src->qplanes[2*i+1]=quant_gain(lo,hi);
+      n+=sprintf(buf+n,"%s%.9g:%.9g",i?",":"",1.0/src->qplanes[2*i+1],lo);
+    }
+    TRY(meta_set(self,"norm_planes",buf));
+    SAFEFREE(buf);
+    self->qmode=2;
+    return 1;
+  } else
+  { if(streq(q,"auto"))
+    { for(i=0;i<src->d;++i)
+        plane_range(src,i,nc,&lo,&hi);
+      if(lo>hi) lo=hi=0.0; // all NaN
+    } else if(2!=sscanf(q,"%lf,%lf",&lo,&hi))
+      FAIL("quantize must be \"lo,hi\", \"auto\" or \"plane\".");
+    self->qlo=lo;
+    self->qk =quant_gain(lo,hi);
+    TRY(meta_setf(self,"norm","%.9g,%.9g",1.0/self->qk,self->qlo));
+  }
+  self->qmode=1;
+  src->qlo=self->qlo;
+  src->qk =self->qk;
+  return 1;
+Error:
+  SAFEFREE(buf);
+  return 0;
+}
+
 /**
   Writes the data in \a to the file \a file.
 
@@ -742,25 +3719,21 @@ static void argmin_sz(size_t n, const size_t *v, size_t *argmin, size_t *min)
 
   Note: May want special handling for 3d data.  Should the 3d be treated as x,y,color or x,y,depth?
  */
-static unsigned write_ffmpeg(ndio_t file, nd_t a)
+static unsigned write_volume(ndio_t file, nd_t a)
 { ndio_ffmpeg_t self;
   nd_t arg=a;
-  int c,w,h,d,i,isok=1;
+  int c,w,h,d,chans,isok=1;
   const size_t *s;
-  size_t planestride,colorstride;
-  int linestride;
-  int pixfmt;
-  AVPacket p={0};
-  int got_packet;
+  src_t src;
   nd_type_id_t oldtype=nd_id_unknown;
   nd_t tmp=0; ///< A temporary copy of a may be needed if a transpose is required for channel ordering
   ndio_ffmpeg_params_t *params=0;
-  AVCodecContext *cctx;
 
   TRY(self=(ndio_ffmpeg_t)ndioContext(file));
   TRY(params=(ndio_ffmpeg_params_t*)ndioGet(file));
-  cctx=CCTX(self);
+  memset(&src,0,sizeof(src));
   s=ndshape(a);
+  chans=params->channel_streams && ndndim(a)==4;
 
   { // maybe flip signed ints to unsigned
     static const nd_type_id_t tmap[] = {
@@ -778,6 +3751,9 @@ static unsigned write_ffmpeg(ndio_t file, nd_t a)
   { case 2:      c=1;         w=(int)s[0]; h=(int)s[1]; d=1;         break;// w,h
     case 3:      c=1;         w=(int)s[0]; h=(int)s[1]; d=(int)s[2]; break;// w,h,d
     case 4:
+      if(chans) // each channel goes to its own gray stream, so any count works
+      { w=(int)s[0]; h=(int)s[1]; d=(int)s[2]; c=(int)s[3];          break;// w,h,d,c
+      }
       // Try to guess which dimension is the color dimension (hint: it's the smallest one of size 1,2,3 or 4)
       { size_t cdim,nc;
         argmin_sz(ndndim(a),s,&cdim,&nc);
@@ -801,32 +3777,37 @@ static unsigned write_ffmpeg(ndio_t file, nd_t a)
     default:
       FAIL("Unsupported number of dimensions.");
   }
-  planestride=ndstrides(a)[ndndim(a)-1];
-  linestride=(int)ndstrides(a)[ndndim(a)-2];
-  colorstride=ndstrides(a)[0];
-  TRY(PIX_FMT_NONE!=(pixfmt=to_pixfmt((int)colorstride,c)));
-  TRY(maybe_init_codec_ctx(self,w,h,24,pixfmt,params));
-  if(self->raw->pts==AV_NOPTS_VALUE)
-    self->raw->pts=0;
-  for(i=0;i<d;++i,++self->raw->pts)
-  { AVFrame *in;
-    av_init_packet(&p); // FIXME: for efficiency, probably want to preallocate packet
-    { const uint8_t* plane=((uint8_t*)nddata(a))+planestride*i;
-      const uint8_t* slice[4]={ plane+colorstride*0,
-                                plane+colorstride*1,
-                                plane+colorstride*2,
-                                plane+colorstride*3};
-      const int stride[4]={linestride,linestride,linestride,linestride};
-      in=self->raw;
-      sws_scale(self->sws,slice,stride,0,h,self->raw->data,self->raw->linesize);
-    }
-    TRY(push(file,&p,self->raw,&got_packet));
+  src.data=(const uint8_t*)nddata(a);
+  src.w=w; src.h=h; src.d=d; src.c=c;
+  src.type=ndtype(a);
+  if(chans)
+  { src.planestride=ndstrides(a)[2];
+    src.linestride=(int)ndstrides(a)[1];
+    src.pixelstride=ndstrides(a)[0];
+    src.colorstride=ndstrides(a)[3];
+  } else
+  { src.planestride=ndstrides(a)[ndndim(a)-1];
+    src.linestride=(int)ndstrides(a)[ndndim(a)-2];
+    src.pixelstride=ndstrides(a)[ndndim(a)==4?1:0]; // c,w,h,d or w,h(,d)
+    src.colorstride=ndstrides(a)[0];
+  }
+  if(quantized(src.type))
+    TRY(init_quantize(file,&src,chans,params));
+  else
+    TRY(PIX_FMT_NONE!=(src.pixfmt=chans?to_pixfmt((int)src.pixelstride,1):to_pixfmt((int)src.colorstride,c)));
+  TRY(maybe_init_encoders(self,&src,24,params));
+  { int nseg=(params->segments>1)?params->segments:1,
+        nthreads=params->threads;
+    if(nthreads<=0 && (nthreads=budget_share()/nseg)<1) // each encoder's share, split among its segments
+      nthreads=1;
+    TRY(encode(file,&src,nseg,nthreads));
   }
 
   // maybe flip back to signed ints
   if(oldtype>nd_id_unknown)
     TRY(ndconvert_ip(arg,oldtype));
 Finalize:
+  SAFEFREE(src.qplanes);
   ndfree(tmp);
   return isok;
 Error:
@@ -834,6 +3815,141 @@ Error:
   goto Finalize;
 }
 
+/** Hands free slots to the caller's callback to fill, in order of z, until
+    every plane has been taken or the write is stopped.  Runs as a thread.
+*/
+static unsigned source_worker(void *arg)
+{ pipe_t *p=(pipe_t*)arg;
+  mutex_lock(p->lock);
+  for(;;)
+  { slot_t *slot;
+    int64_t z;
+    int ok;
+    while(!p->stop && p->take<p->end && p->slots[p->take%p->n].z>=0)
+      cond_wait(p->cv,p->lock);
+    if(p->stop || p->take>=p->end)
+      break;
+    z=p->take++;
+    slot=p->slots+z%p->n;
+    slot->z=z;
+    slot->ready=0;
+    mutex_unlock(p->lock);
+    ok=p->s->fn(p->s->ctx,slot->a,z);
+    mutex_lock(p->lock);
+    slot->ready=1;
+    if(!ok && z<p->end) // the file ends before this plane
+      p->end=z;
+    cond_broadcast(p->cv);
+  }
+  mutex_unlock(p->lock);
+  return 1;
+}
+
+/** Writes the planes of a volume shaped like \a a, produced on demand by
+    the caller's callback (see ndio_ffmpeg_params_t::source).  Worker threads
+    fill a ring of plane buffers while this thread converts and encodes them
+    in order, so only \a depth planes are ever in memory.  \a a gives only
+    the shape and type; its data is not read.
+*/
+static unsigned source_volume(ndio_t file, nd_t a, ndio_ffmpeg_stream_t *s)
+{ ndio_ffmpeg_params_t *params=(ndio_ffmpeg_params_t*)ndioGet(file);
+  pipe_t p;
+  thread_t *threads=0;
+  nd_t plane=0;
+  size_t shape[4];
+  int64_t i;
+  int k,nw=(s->workers>1)?s->workers:1,isok=1;
+  memset(&p,0,sizeof(p));
+  TRY(s->fn);
+  switch(ndndim(a))
+  { case 2: case 3: break;
+    case 4:
+      if(params->channel_streams) break;
+      FAIL("Streamed writes of w,h,d,c arrays need channel_streams, so each plane keeps its channel dimension.");
+    default:
+      FAIL("Streamed writes take w,h,d or w,h,d,c arrays.");
+  }
+  memcpy(shape,ndshape(a),sizeof(*shape)*ndndim(a));
+  p.end=(ndndim(a)>2)?(int64_t)shape[2]:1;
+  if(ndndim(a)>2)
+    shape[2]=1;
+  TRY(ndcast(ndreshape(plane=ndinit(),ndndim(a),shape),ndtype(a)));
+  p.s=s;
+  p.n=(s->depth>0)?s->depth:2*nw;
+  NEW(slot_t,p.slots,p.n);
+  memset(p.slots,0,sizeof(slot_t)*p.n);
+  for(k=0;k<p.n;++k)
+  { TRY(p.slots[k].a=ndheap(plane));
+    p.slots[k].z=-1;
+  }
+  TRY(p.lock=mutex_alloc());
+  TRY(p.cv=cond_alloc());
+  s->nplanes=0;
+  NEW(thread_t,threads,nw);
+  memset(threads,0,sizeof(thread_t)*nw);
+  for(k=0;k<nw;++k)
+    TRY(threads[k]=thread_start(source_worker,&p));
+  for(i=0;;++i)
+  { slot_t *slot=p.slots+i%p.n;
+    int go;
+    mutex_lock(p.lock);
+    while(!p.stop && i<p.end && !(slot->z==i && slot->ready))
+      cond_wait(p.cv,p.lock);
+    go=!p.stop && i<p.end;
+    mutex_unlock(p.lock);
+    if(!go)
+      break;
+    TRY(write_volume(file,slot->a));
+    mutex_lock(p.lock);
+    slot->z=-1;
+    ++s->nplanes;
+    cond_broadcast(p.cv);
+    mutex_unlock(p.lock);
+  }
+Finalize:
+  if(p.lock && p.cv)
+  { mutex_lock(p.lock);
+    if(!isok) p.stop=1;
+    cond_broadcast(p.cv);
+    mutex_unlock(p.lock);
+  }
+  if(threads)
+    for(k=0;k<nw;++k)
+      if(threads[k])
+        isok&=thread_join(threads[k]);
+  SAFEFREE(threads);
+  if(p.slots)
+    for(k=0;k<p.n;++k)
+      ndfree(p.slots[k].a);
+  SAFEFREE(p.slots);
+  cond_free(p.cv);
+  mutex_free(p.lock);
+  ndfree(plane);
+  return isok;
+Error:
+  isok=0;
+  goto Finalize;
+}
+
+/** Writes \a a to \a file, appending its planes to the stream.
+    5D arrays go to the part files (see \ref ndio-ffmpeg-parts).  With
+    ndio_ffmpeg_params_t::source, planes are pulled from a callback instead.
+*/
+static unsigned write_ffmpeg(ndio_t file, nd_t a)
+{ ndio_ffmpeg_params_t *params;
+  TRY(params=(ndio_ffmpeg_params_t*)ndioGet(file));
+  if(ndndim(a)==5) // x,y,z,c,t
+  { if(params->source)
+      FAIL("Streamed writes of 5D arrays aren't supported.  Stream each part's volume to its own file.");
+    return write_parts(file,a);
+  }
+  if(params->source)
+    return source_volume(file,a,params->source);
+  return write_volume(file,a);
+Error:
+  return 0;
+}
+
 struct ffmpeg {
   ndio_ffmpeg_params_t params;
   ndio_fmt_t           api;
@@ -852,11 +3968,18 @@ static void* get(ndio_fmt_t *fmt)
   return &ctx->params;
 }
 
+/** Default encoder settings: x264 at crf 18. */
+static void defaults(ndio_ffmpeg_params_t *p)
+{ memset(p,0,sizeof(*p));
+  p->crf     ="18";
+  p->preset  ="slow";
+  p->tune    ="film";
+  p->lossless=0;
+  p->threads =0;
+}
+
 static void finalize(ndio_fmt_t *fmt)
-{ ndio_ffmpeg_params_t *p=ndioFormatGet(fmt);
-  p->crf   ="18";
-  p->preset="slow";
-  p->tune  ="film";
+{ defaults((ndio_ffmpeg_params_t*)ndioFormatGet(fmt));
 }
 
 
@@ -877,9 +4000,7 @@ shared const ndio_fmt_t* ndio_get_format_api(void)
 { static ndio_ffmpeg_params_t params;
   static ndio_fmt_t api = {0};
   static struct ffmpeg out;
-  params.crf   ="18";
-  params.preset="slow";
-  params.tune  ="film";
+  defaults(&params);
   maybe_init();
   api.name   = name_ffmpeg;
   api.is_fmt = is_ffmpeg;
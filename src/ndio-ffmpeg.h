@@ -1,10 +1,86 @@
 // ndio-ffmpeg parameters
 
 #pragma once
+#include <stdint.h>
+#include "nd.h"
+
+/** A decoded frame as the decoder left it: no conversion, no copy (see
+    ndio_ffmpeg_stream_t::native).  Borrowed: the planes belong to the
+    decoder and are only valid until the callback returns.
+*/
+typedef struct ndio_ffmpeg_frame_t_ {
+  const uint8_t *data[4];     ///< Plane pointers, as AVFrame::data.  With ndio_ffmpeg_params_t::roi, they point at the region's origin.
+  int            linesize[4]; ///< Bytes per line of each plane, as AVFrame::linesize.
+  int            w,h;         ///< Size of the frame (or region) in pixels.  Chroma planes may be subsampled; see \a pixfmt.
+  int            pixfmt;      ///< The decoder's FFmpeg PixelFormat, e.g. PIX_FMT_YUV420P.  Luma is plane 0.
+} ndio_ffmpeg_frame_t;
+
+/** A pipelined read or write (see ndio_ffmpeg_params_t::stream and
+    ndio_ffmpeg_params_t::source).  Planes pass through a ring of \a depth
+    buffers between worker threads calling \a fn and the calling thread,
+    which decodes (or converts and encodes) them, so the two overlap and
+    memory use doesn't grow with the length of the file.
+*/
+typedef struct ndio_ffmpeg_stream_t_ {
+  int   (*fn)(void *ctx, nd_t plane, int64_t z); ///< Reads: called with each decoded plane.  Writes: fills plane \a z.  \a plane is borrowed: its buffer is reused once \a fn returns.  Returning 0 ends the read or write early (not an error); a write then ends before plane \a z.
+  int   (*native)(void *ctx, const ndio_ffmpeg_frame_t *frame, int64_t z); ///< Reads: if set, called instead of \a fn with each frame in the decoder's own pixel format, on the decoding thread.  Skips conversion entirely.  Files holding a single video stream only.  Returning 0 ends the read early.  ndioReadSubarray() of plane z calls it for frame z alone, seeking as needed; the destination array is then not written.
+  void   *ctx;      ///< Passed to \a fn.
+  int     depth;    ///< Planes in flight: the size of the ring.  0 uses two per worker.
+  int     workers;  ///< Threads calling \a fn.  0 or 1 calls it on one thread, in order of z.  With more, planes may finish out of order (writes still encode them in order).
+  int64_t nplanes;  ///< Output: the number of planes handed to \a fn (reads) or written.
+} ndio_ffmpeg_stream_t;
+
+/** Reductions computed while a file is decoded (see ndio_ffmpeg_params_t::reduce).
+    Each plane is reduced as soon as it is converted and then overwritten by
+    the next, so the volume is never held in memory.  Outputs are allocated by
+    the caller; NULL ones are skipped.  Planes are w*h u16 values, x fastest.
+*/
+typedef struct ndio_ffmpeg_reduce_t_ {
+  uint16_t *max;        ///< w*h: maximum intensity projection along z.
+  uint16_t *min;        ///< w*h: minimum intensity projection along z.
+  uint32_t *sum;        ///< w*h: sum along z.  Divide by \a nplanes for the mean.  Wraps past 65537 planes of full-scale data.
+  double   *plane_mean; ///< d: the mean of each plane.
+  uint16_t *plane_min;  ///< d: the minimum of each plane.
+  uint16_t *plane_max;  ///< d: the maximum of each plane.
+  uint64_t *hist;       ///< 65536 bins: the intensity histogram of the whole volume.
+  int     (*fn)(void *ctx, const uint16_t *plane, int w, int h, size_t linestride, int64_t z); ///< Called with each plane after the reducers above.  \a linestride is in bytes.  Returning 0 stops the read early (not an error).
+  void     *ctx;        ///< Passed to \a fn.
+  int64_t   nplanes;    ///< Output: the number of planes reduced.
+} ndio_ffmpeg_reduce_t;
 
 typedef struct ndio_ffmpeg_params_t_ {
   char *crf;
   char *preset;
   char *tune;
+  int   lossless; ///< If nonzero, encode with FFV1 version 3 (bit-exact). The container must accept FFV1 (mkv, nut, avi).
+  int   threads;  ///< Encoder threads.  0 takes a share of the process-wide thread budget (see thread.h).
+  int   split16;  ///< If nonzero, u16 planes are stored as two 8-bit streams (high byte, low byte), each encoded on its own thread.
+  char *hi_codec; ///< Encoder name for the high-byte stream when \a split16 is set.  NULL uses the container's default.
+  char *lo_codec; ///< Encoder name for the low-byte stream when \a split16 is set.  NULL uses "ffv1" (lossless).
+  char *window;   ///< Intensity window for single channel u16 data stored at 8 bits: "lo,hi", "auto" or "auto,plo,phi" (percentiles, default 0.1,99.9).  NULL lets swscale truncate.
+  double gamma;   ///< With \a window, values in the window map as ((x-lo)/(hi-lo))^(1/gamma).  0 means 1 (linear).
+  char *anscombe; ///< Variance-stabilize before the 8-bit window: "gain,offset,sigma" (detector gain, dark level, read noise; "1,0,0" is the plain Anscombe transform).  Levels are then spaced evenly in shot noise instead of intensity, so the encoder stops spending bits on noise in bright regions.  Implies \a window "auto" when that's NULL.  Readers undo it.
+  int   segments; ///< Encode the planes of each write as this many independent (closed GOP) segments, concurrently.  Output is one stream, in order.  0 or 1 encodes serially.
+  int   fragment; ///< Flush the output to disk every this many frames, so it survives a crash and can be read while it grows.  mp4/mov are written as fragmented mp4.  0 disables.
+  double fragment_seconds; ///< Also flush when this many seconds have passed since the last flush.  0 disables.
+  double follow;   ///< Reading: for files still being written, wait up to this many seconds for frames past the current end.  The frame count grows as frames arrive.  nut files only.  0 disables.
+  int   chunk;    ///< Start a closed GOP (a keyframe nothing earlier refers to) every this many planes.  -1 starts one at every write and records where (mp4 keeps the list; mkv and nut files are scanned for keyframes instead).  0 leaves keyframes to the encoder.  Readers decode chunks in parallel.
+  char *profile;  ///< Read-back access pattern to tune the GOP structure for: "archive", "random-access" or "intra".  NULL keeps the encoder's defaults.  See app/bench/seekcost.c to measure the trade-off.
+  char *codec_options;   ///< Extra encoder options as "key=value;key=value".  Codec context fields (g, bf, refs, threads, slices...) or the encoder's private options (x264's x264opts, FFV1's slicecrc...).  Unknown keys fail the write.
+  char *format_options;  ///< Extra muxer options, e.g. "movflags=+faststart".  Unknown keys fail the write.
+  char *decoder_options; ///< Reading: extra decoder options, e.g. "threads=4;thread_type=frame".  Unknown keys fail the open.
+  char *demux_options;   ///< Reading: extra demuxer options, e.g. "probesize=100000".  Unknown keys fail the open.
+  int   decoder_threads;   ///< Reading: decoder threads.  0 takes a share of the process-wide thread budget, rebalanced at seeks.
+  char *decoder_threading; ///< Reading: "frame", "slice" or "auto" (both).  NULL uses slices for FFV1 and the decoder's default otherwise.
+  char *streams;           ///< Reading: the video streams to read, as "i,j,..." (stream indices) or "all" (every video stream with the same size and pixel format as the best one).  Several streams are returned as dimension 3 (w,h,d,c) and decoded concurrently from one pass over the file.  NULL reads the best stream, or the channel streams of files written with \a channel_streams.
+  int   channel_streams;   ///< If nonzero, each channel of a 4D array (w,h,d,c) is written as its own gray stream, encoded concurrently.  Any number of channels.  Readers decode the streams in parallel and return w,h,d,c.
+  char *tile;     ///< Split each plane into tiles of "w,h" pixels, each encoded as its own stream, concurrently.  Single channel data only.  NULL writes whole planes.
+  char *roi;      ///< Reading: the region of each plane to read, as "x,y,w,h".  Only the region is converted and copied, so "0,y,W,1" reads an XZ section and "x,0,1,H" a YZ one at little more than the cost of decoding.  For tiled files, only the tiles it touches are decoded (their packets are all still demuxed).  Fixed at open: subarray reads seek only along z.  NULL reads whole planes.
+  ndio_ffmpeg_reduce_t *reduce; ///< Reading: if set, ndioRead() streams every plane through these reductions instead of filling the array, which needs only hold one w,h u16 plane.  Single channel files only.
+  ndio_ffmpeg_stream_t *stream; ///< Reading: if set, ndioRead() hands each plane to a callback instead of filling the array.  The array is only the shape and type of one plane (w,h or w,h,1,c; u16 or f32) and is not written.
+  ndio_ffmpeg_stream_t *source; ///< Writing: if set, ndioWrite() pulls the planes from a callback instead of the array.  The array gives only the shape and type (w,h,d, or w,h,d,c with \a channel_streams); its data may be NULL.  Each plane is its own write, so \a chunk -1 makes every plane a keyframe and \a segments has no effect.
+  double scale;   ///< Reading into nd_f32 arrays: each value x is returned as x*scale+offset.  0 uses the constants the writer recorded, or 1/65535 (0 to 1).  Writing: if nonzero, recorded with \a offset as the file's constants for f32 readers.
+  double offset;  ///< See \a scale.
+  char *quantize; ///< Writing float or 32/64-bit arrays: how samples map to u16 before encoding.  "lo,hi" maps that range onto 0..65535, "auto" (the default) uses the smallest and largest sample of the first write, "plane" each plane's own range (the whole volume in one write).  Both find the range in an extra pass over the write before encoding.  The mapping is recorded so f32 readers get approximately the original values back.  Streamed writes (see \a source) should give a fixed range.
+  const unsigned char *lut; ///< Precomputed 65536-entry u16 to u8 table.  Overrides \a window and \a gamma.  Readers map each level back to the mean input that produced it, except that the saturated runs at either end map back to where they start.
 } ndio_ffmpeg_params_t;
-
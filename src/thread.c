@@ -0,0 +1,188 @@
+/**
+ * \file
+ * Minimal portable threading support used by the plugin.
+ *
+ * Posix threads everywhere except Windows.
+ */
+#include "thread.h"
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#define HAVE_WIN32_THREADS
+#include <windows.h>
+#else
+#define HAVE_POSIX_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+struct _thread_t
+{ thread_fn_t fn;
+  void       *arg;
+  unsigned    result;
+#ifdef HAVE_WIN32_THREADS
+  HANDLE      handle;
+#endif
+#ifdef HAVE_POSIX_THREADS
+  pthread_t   handle;
+#endif
+};
+
+struct _mutex_t
+{
+#ifdef HAVE_WIN32_THREADS
+  CRITICAL_SECTION cs;
+#endif
+#ifdef HAVE_POSIX_THREADS
+  pthread_mutex_t  m;
+#endif
+};
+
+struct _cond_t
+{
+#ifdef HAVE_WIN32_THREADS
+  CONDITION_VARIABLE cv;
+#endif
+#ifdef HAVE_POSIX_THREADS
+  pthread_cond_t     cv;
+#endif
+};
+
+#ifdef HAVE_WIN32_THREADS
+int thread_ncpu(void)
+{ SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors>0?(int)info.dwNumberOfProcessors:1;
+}
+
+static DWORD WINAPI trampoline(LPVOID arg)
+{ thread_t self=(thread_t)arg;
+  self->result=self->fn(self->arg);
+  return 0;
+}
+
+thread_t thread_start(thread_fn_t fn, void *arg)
+{ thread_t self;
+  if(!(self=(thread_t)calloc(1,sizeof(*self)))) return 0;
+  self->fn=fn;
+  self->arg=arg;
+  if(!(self->handle=CreateThread(NULL,0,trampoline,self,0,NULL)))
+  { free(self);
+    return 0;
+  }
+  return self;
+}
+
+unsigned thread_join(thread_t self)
+{ unsigned r;
+  if(!self) return 0;
+  WaitForSingleObject(self->handle,INFINITE);
+  CloseHandle(self->handle);
+  r=self->result;
+  free(self);
+  return r;
+}
+
+mutex_t mutex_alloc(void)
+{ mutex_t self;
+  if(!(self=(mutex_t)calloc(1,sizeof(*self)))) return 0;
+  InitializeCriticalSection(&self->cs);
+  return self;
+}
+void mutex_free(mutex_t self)   { if(!self) return; DeleteCriticalSection(&self->cs); free(self); }
+void mutex_lock(mutex_t self)   { EnterCriticalSection(&self->cs); }
+void mutex_unlock(mutex_t self) { LeaveCriticalSection(&self->cs); }
+
+cond_t cond_alloc(void)
+{ cond_t self;
+  if(!(self=(cond_t)calloc(1,sizeof(*self)))) return 0;
+  InitializeConditionVariable(&self->cv);
+  return self;
+}
+void cond_free(cond_t self)              { free(self); } // win32 condition variables need no cleanup
+void cond_wait(cond_t self, mutex_t m)   { SleepConditionVariableCS(&self->cv,&m->cs,INFINITE); }
+void cond_broadcast(cond_t self)         { WakeAllConditionVariable(&self->cv); }
+#endif
+
+#ifdef HAVE_POSIX_THREADS
+int thread_ncpu(void)
+{ long n=sysconf(_SC_NPROCESSORS_ONLN);
+  return n>0?(int)n:1;
+}
+
+static void* trampoline(void *arg)
+{ thread_t self=(thread_t)arg;
+  self->result=self->fn(self->arg);
+  return 0;
+}
+
+thread_t thread_start(thread_fn_t fn, void *arg)
+{ thread_t self;
+  if(!(self=(thread_t)calloc(1,sizeof(*self)))) return 0;
+  self->fn=fn;
+  self->arg=arg;
+  if(pthread_create(&self->handle,NULL,trampoline,self))
+  { free(self);
+    return 0;
+  }
+  return self;
+}
+
+unsigned thread_join(thread_t self)
+{ unsigned r;
+  if(!self) return 0;
+  pthread_join(self->handle,NULL);
+  r=self->result;
+  free(self);
+  return r;
+}
+
+mutex_t mutex_alloc(void)
+{ mutex_t self;
+  if(!(self=(mutex_t)calloc(1,sizeof(*self)))) return 0;
+  if(pthread_mutex_init(&self->m,NULL))
+  { free(self);
+    return 0;
+  }
+  return self;
+}
+void mutex_free(mutex_t self)   { if(!self) return; pthread_mutex_destroy(&self->m); free(self); }
+void mutex_lock(mutex_t self)   { pthread_mutex_lock(&self->m); }
+void mutex_unlock(mutex_t self) { pthread_mutex_unlock(&self->m); }
+
+cond_t cond_alloc(void)
+{ cond_t self;
+  if(!(self=(cond_t)calloc(1,sizeof(*self)))) return 0;
+  if(pthread_cond_init(&self->cv,NULL))
+  { free(self);
+    return 0;
+  }
+  return self;
+}
+void cond_free(cond_t self)              { if(!self) return; pthread_cond_destroy(&self->cv); free(self); }
+void cond_wait(cond_t self, mutex_t m)   { pthread_cond_wait(&self->cv,&m->m); }
+void cond_broadcast(cond_t self)         { pthread_cond_broadcast(&self->cv); }
+#endif
+
+//
+// Budget
+//
+
+static volatile long budget_users=0; ///< Number of contexts sharing the processors
+
+#ifdef HAVE_WIN32_THREADS
+static long budget_add(long d) { return InterlockedExchangeAdd(&budget_users,d)+d; }
+#endif
+#ifdef HAVE_POSIX_THREADS
+static long budget_add(long d) { return __sync_add_and_fetch(&budget_users,d); }
+#endif
+
+static int share_of(long users)
+{ int n=thread_ncpu();
+  if(users<1) users=1;
+  return (n/users)>0?(int)(n/users):1;
+}
+
+int  budget_join(void)  { return share_of(budget_add(1)); }
+void budget_leave(void) { budget_add(-1); }
+int  budget_share(void) { return share_of(budget_users); }
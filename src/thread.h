@@ -0,0 +1,35 @@
+#pragma once
+/** \file
+ *  Minimal portable threading support used by the plugin.
+ */
+
+typedef struct _thread_t *thread_t;
+typedef struct _mutex_t  *mutex_t;
+typedef struct _cond_t   *cond_t;
+typedef unsigned (*thread_fn_t)(void *arg); ///< Thread entry point. Returns 1 on success, 0 otherwise.
+
+int      thread_ncpu(void);                        ///< \returns the number of online processors (at least 1).
+thread_t thread_start(thread_fn_t fn, void *arg);  ///< Starts \a fn(arg) on a new thread. \returns 0 on failure.
+unsigned thread_join(thread_t self);               ///< Waits for the thread to finish and releases it. \returns the thread function's result.
+
+mutex_t  mutex_alloc(void);
+void     mutex_free(mutex_t self);
+void     mutex_lock(mutex_t self);
+void     mutex_unlock(mutex_t self);
+
+cond_t   cond_alloc(void);
+void     cond_free(cond_t self);
+void     cond_wait(cond_t self, mutex_t m); ///< Releases \a m while waiting and holds it again on return.  May wake spuriously, so wait in a loop.
+void     cond_broadcast(cond_t self);       ///< Wakes every waiter.
+
+/** \name Process-wide thread budget
+ *  Codec contexts that don't ask for a thread count share the processors.
+ *  Each joins the budget when it opens and leaves when it closes, and gets
+ *  the processors divided by the number of contexts, so the total stays
+ *  near the processor count no matter how many files are open.
+ */
+///@{
+int      budget_join(void);  ///< Counts one more context against the budget. \returns its share of processors (at least 1).
+void     budget_leave(void); ///< Releases a share taken with budget_join().
+int      budget_share(void); ///< \returns the current share of processors per context (at least 1).
+///@}